@@ -0,0 +1,338 @@
+/*
+ * bsearch.h - searching sorted arrays, in sorted or cache friendly layouts
+ * Copyright (C) 2014 Daniel Santos <daniel.santos@pobox.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/* The searches here compare through def->less, inlined like the sorts do,
+ * and don't branch on its result: each step picks the next probe with a
+ * conditional move, so their cost is the memory latency of the probes rather
+ * than mispredictions. How much of that latency is hidden depends on
+ * def->layout:
+ *
+ * QSORT_LAYOUT_SORTED:    a plain binary search that prefetches both of the
+ *                         elements it may probe next.
+ * QSORT_LAYOUT_EYTZINGER: the elements of each level of the search tree are
+ *                         together, so the (up to) 2^d candidates d levels
+ *                         down are contiguous and a cache line's worth of
+ *                         them is prefetched each step.
+ * QSORT_LAYOUT_BTREE:     nodes of B elements fill a cache line, so a
+ *                         search misses once per level of a tree that is
+ *                         log2(B + 1) times shallower. Best for elements
+ *                         whose size divides _QSORT_BTREE_NODE.
+ *
+ * search_layout_template produces the latter two from a sorted array. Keys
+ * are passed as elements (or anything def->less accepts in their place).
+ */
+
+#ifndef _BSEARCH_H_
+#define _BSEARCH_H_
+
+#include <stddef.h>
+#include <string.h>
+
+#include "qsort.h"
+
+/* Bytes per B-tree node for QSORT_LAYOUT_BTREE, normally a cache line. */
+#ifndef _QSORT_BTREE_NODE
+# define _QSORT_BTREE_NODE 64
+#endif
+
+/* Bytes the Eytzinger search prefetches ahead of itself. */
+#ifndef _QSORT_EYTZINGER_PREFETCH
+# define _QSORT_EYTZINGER_PREFETCH 64
+#endif
+
+/* elements per B-tree node, at least two */
+static __always_inline size_t _bsearch_btree_keys(const struct qsort_def *def) {
+	return _QSORT_BTREE_NODE / def->size < 2 ? 2
+					       : _QSORT_BTREE_NODE / def->size;
+}
+
+/* non-zero if elem goes before the result: elem < key for a lower bound,
+ * elem <= key for an upper bound */
+static __always_inline int
+_bsearch_before(const struct qsort_def *def, const void *elem, const void *key,
+		int upper, void *arg) {
+	_QSORT_STAT_ADD(def, compares, 1);
+	return upper ? !def->less(key, elem, arg) : def->less(elem, key, arg);
+}
+
+/* the first of n sorted elements not before key, or NULL */
+static __always_inline const char *
+_bsearch_sorted(const struct qsort_def *def, const char *base, size_t n,
+		const void *key, int upper, void *arg) {
+	const size_t size = def->size;
+	const char *const end = base + n * size;
+	const char *lo = base;
+
+	if (!n)
+		return NULL;
+
+	while (n > 1) {
+		const size_t half = n / 2;
+
+		/* the next probe is in one half or the other */
+		__builtin_prefetch(lo + (half / 2) * size);
+		__builtin_prefetch(lo + (half + half / 2) * size);
+
+		lo = _bsearch_before(def, lo + half * size, key, upper, arg)
+		   ? lo + half * size : lo;
+		n -= half;
+	}
+
+	lo += _bsearch_before(def, lo, key, upper, arg) * size;
+	return lo != end ? lo : NULL;
+}
+
+/* the Eytzinger slot (from 1) of the first element not before key, or 0 */
+static __always_inline size_t
+_bsearch_eytzinger(const struct qsort_def *def, const char *tree, size_t n,
+		   const void *key, int upper, void *arg) {
+	const size_t size = def->size;
+	/* descendants this many levels down fill the prefetch */
+	const unsigned levels = _QSORT_EYTZINGER_PREFETCH / size < 2 ? 1
+		: sizeof(long) * CHAR_BIT - 1
+		  - __builtin_clzl(_QSORT_EYTZINGER_PREFETCH / size);
+	size_t k = 1;
+
+	while (k <= n) {
+		__builtin_prefetch(tree + ((k << levels) - 1) * size);
+		k = 2 * k + _bsearch_before(def, tree + (k - 1) * size, key,
+					    upper, arg);
+	}
+
+	/* undo the right turns after the last left one */
+	return k >> __builtin_ffsl(~k);
+}
+
+/* the first element of a B-tree not before key, or NULL */
+static __always_inline const char *
+_bsearch_btree(const struct qsort_def *def, const char *tree, size_t n,
+	       const void *key, int upper, void *arg) {
+	const size_t size = def->size;
+	const size_t b = _bsearch_btree_keys(def);
+	const size_t nodes = (n + b - 1) / b;
+	const char *ret = NULL;
+	size_t k = 0;
+
+	while (k < nodes) {
+		const char *node = tree + k * b * size;
+		size_t i = 0;
+		size_t j;
+
+		/* count rather than search: the node is one cache line, so
+		 * comparing all of it costs no more than finding the spot */
+#pragma GCC unroll 16
+		for (j = 0; j < b; ++j)
+			i += _bsearch_before(def, node + j * size, key, upper,
+					     arg);
+
+		ret = i < b ? node + i * size : ret;
+		k = k * (b + 1) + i + 1;
+	}
+	return ret;
+}
+
+static __always_inline const char *
+_bsearch_bound(const struct qsort_def *def, const void *base, size_t n,
+	       const void *key, int upper, void *arg) {
+	assert_const(def->layout);
+	assert_const(def->size);
+
+	switch (def->layout) {
+	case QSORT_LAYOUT_SORTED:
+		return _bsearch_sorted(def, base, n, key, upper, arg);
+	case QSORT_LAYOUT_EYTZINGER: {
+		const size_t k = _bsearch_eytzinger(def, base, n, key, upper,
+						    arg);
+
+		return k ? (const char *)base + (k - 1) * def->size : NULL;
+	}
+	case QSORT_LAYOUT_BTREE:
+		return _bsearch_btree(def, base, n, key, upper, arg);
+	default:
+		BUILD_BUG();
+		return NULL;
+	}
+}
+
+/**
+ * lower_bound_template - find the first element not less than key
+ * @def:  the template parameters; def->layout is the layout of base
+ * @base: the array, sorted or as search_layout_template left it
+ * @n:    number of elements
+ * @key:  what to search for, passed to def->less as an element
+ * @arg:  passed to def->less
+ *
+ * Returns the element, or NULL if all are less than key. In sorted layout
+ * that is the position key would be inserted at; in the others it is only a
+ * way to reach the element.
+ */
+static __always_inline __flatten void *
+lower_bound_template (const struct qsort_def *def, const void *base, size_t n,
+                      const void *key, void *arg)
+{
+  return (void *) _bsearch_bound (def, base, n, key, 0, arg);
+}
+
+/**
+ * upper_bound_template - find the first element greater than key
+ * @def:  the template parameters; def->layout is the layout of base
+ * @base: the array, sorted or as search_layout_template left it
+ * @n:    number of elements
+ * @key:  what to search for, passed to def->less as an element
+ * @arg:  passed to def->less
+ *
+ * Returns the element, or NULL if none is greater than key.
+ */
+static __always_inline __flatten void *
+upper_bound_template (const struct qsort_def *def, const void *base, size_t n,
+                      const void *key, void *arg)
+{
+  return (void *) _bsearch_bound (def, base, n, key, 1, arg);
+}
+
+/**
+ * bsearch_template - find an element equal to key
+ * @def:  the template parameters; def->layout is the layout of base
+ * @base: the array, sorted or as search_layout_template left it
+ * @n:    number of elements
+ * @key:  what to search for, passed to def->less as an element
+ * @arg:  passed to def->less
+ *
+ * Returns the first of the elements equal to key (neither less nor greater)
+ * in sorted order, or NULL if there are none.
+ */
+static __always_inline __flatten void *
+bsearch_template (const struct qsort_def *def, const void *base, size_t n,
+                  const void *key, void *arg)
+{
+  const char *p = _bsearch_bound (def, base, n, key, 0, arg);
+
+  return p && !def->less (key, p, arg) ? (void *) p : NULL;
+}
+
+/**
+ * search_layout_size - bytes search_layout_template needs for n elements
+ * @def: the template parameters, with the layout wanted
+ * @n:   number of elements
+ *
+ * B-tree nodes are always full, so that layout may need up to a node's worth
+ * of elements more than the sorted array.
+ */
+static __always_inline size_t
+search_layout_size(const struct qsort_def *def, size_t n) {
+	const size_t b = _bsearch_btree_keys(def);
+
+	if (def->layout == QSORT_LAYOUT_BTREE)
+		return (n + b - 1) / b * b * def->size;
+	return n * def->size;
+}
+
+/* fill the Eytzinger slots (numbered from 1) of dst in order from src, by an
+ * in-order walk of the implicit tree: go as far left as possible, fill that
+ * slot, then move on to the leftmost slot of its right subtree or back up to
+ * the first unfilled ancestor */
+static __always_inline void
+_search_layout_eytzinger(const struct qsort_def *def, const char *src,
+			 char *dst, size_t n) {
+	const size_t size = def->size;
+	size_t i = 0;
+	size_t k = 1;
+
+	while (2 * k <= n)
+		k *= 2;
+
+	while (i < n) {
+		memcpy(dst + (k - 1) * size, src + i++ * size, size);
+
+		if (2 * k + 1 <= n) {
+			k = 2 * k + 1;
+			while (2 * k <= n)
+				k *= 2;
+		} else {
+			/* climb while coming from a right child */
+			k >>= __builtin_ffsl(~k);
+		}
+	}
+}
+
+/* lay out the B-tree node k and everything under it, taking elements from
+ * src in order starting at t; positions past n repeat the last element,
+ * which keeps the in-order sequence sorted. Returns the next t. */
+static inline size_t
+_search_layout_btree(size_t size, size_t b, const char *src, char *dst,
+		     size_t n, size_t nodes, size_t k, size_t t) {
+	size_t i;
+
+	if (k >= nodes)
+		return t;
+
+	for (i = 0; i < b; ++i) {
+		t = _search_layout_btree(size, b, src, dst, n, nodes,
+					 k * (b + 1) + i + 1, t);
+		memcpy(dst + (k * b + i) * size,
+		       src + (t < n ? t : n - 1) * size, size);
+		++t;
+	}
+	return _search_layout_btree(size, b, src, dst, n, nodes,
+				    k * (b + 1) + b + 1, t);
+}
+
+/**
+ * search_layout_template - lay a sorted array out for searching
+ * @def: the template parameters; def->layout is the layout wanted
+ * @src: the sorted array
+ * @dst: search_layout_size(def, n) bytes, aligned like src, for the result
+ * @n:   number of elements
+ *
+ * The result is for the searches here (with the same def) only. For
+ * QSORT_LAYOUT_SORTED this is just a copy. For QSORT_LAYOUT_BTREE, align dst
+ * to _QSORT_BTREE_NODE so that each node is in one cache line; straddling
+ * two undoes most of the layout's benefit.
+ */
+static __always_inline __flatten void
+search_layout_template (const struct qsort_def *def, const void *src,
+                        void *dst, size_t n)
+{
+  const size_t size = def->size;
+
+  assert_const(def->layout);
+  assert_const(size);
+
+  switch (def->layout)
+    {
+    case QSORT_LAYOUT_SORTED:
+      memcpy (dst, src, n * size);
+      break;
+    case QSORT_LAYOUT_EYTZINGER:
+      _search_layout_eytzinger (def, src, dst, n);
+      break;
+    case QSORT_LAYOUT_BTREE:
+      {
+        const size_t b = _bsearch_btree_keys (def);
+
+        if (n)
+          _search_layout_btree (size, b, src, dst, n, (n + b - 1) / b, 0, 0);
+        break;
+      }
+    default:
+      BUILD_BUG();
+    }
+}
+
+#endif /* _BSEARCH_H_ */
@@ -0,0 +1,264 @@
+/*
+ * bsearch_test - benchmark for bsearch_template and its layouts
+ * Copyright (C) 2014 Daniel Santos <daniel.santos@pobox.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/* usage: bsearch_test [max_bytes [lookups [repeat_count]]]
+ *
+ * For arrays of 4 KiB (L1) up to max_bytes (DRAM), quadrupling, of distinct
+ * sorted elements, looks up random keys, about half of them present,
+ * with libc bsearch and with bsearch_template on the sorted array and on its
+ * Eytzinger and B-tree layouts. Every search's answer is checked against
+ * bsearch's. Prints the time per lookup of each as CSV. */
+
+#define  _ISOC11_SOURCE
+#define _GNU_SOURCE
+
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <error.h>
+#include <assert.h>
+
+#include "bsearch.h"
+#include "utils.h"
+#include "test_elem.h"
+
+#ifndef MAX_BYTES
+# define MAX_BYTES ((size_t)256 << 20)
+#endif
+
+#ifndef LOOKUPS
+# define LOOKUPS (1024 * 1024)
+#endif
+
+#define MIN_BYTES ((size_t)4 << 10)
+
+/* the keys run up to twice the element count, too many for 1 or 2 bytes */
+static __always_inline void my_set_key(void *p, uint64_t k) {
+	BUILD_BUG_ON(ELEM_SIZE < 4);
+
+	memset(p, 0, ELEM_SIZE);
+	if (ELEM_SIZE < 8)
+		*(uint32_t *)__builtin_assume_aligned(p, ALIGN_SIZE) = k;
+	else
+		*(uint64_t *)__builtin_assume_aligned(p, ALIGN_SIZE) = k;
+}
+
+static int my_cmp(const void *a, const void *b) {
+	return my_less(a, b, NULL) ? -1 : my_less(b, a, NULL);
+}
+
+static const struct qsort_def my_def = {
+	.size = ELEM_SIZE,
+	.align = ALIGN_SIZE,
+	.less = my_less,
+};
+
+static const struct qsort_def my_eytzinger_def = {
+	.size = ELEM_SIZE,
+	.align = ALIGN_SIZE,
+	.less = my_less,
+	.layout = QSORT_LAYOUT_EYTZINGER,
+};
+
+static const struct qsort_def my_btree_def = {
+	.size = ELEM_SIZE,
+	.align = ALIGN_SIZE,
+	.less = my_less,
+	.layout = QSORT_LAYOUT_BTREE,
+};
+
+typedef const void *(*search_fn_t)(const void *base, size_t n, const void *key);
+
+/* using static noinline to make it easier to examine generated code */
+
+static __noinline const void *libc_search(const void *base, size_t n, const void *key) {
+	return bsearch(key, base, n, ELEM_SIZE, my_cmp);
+}
+
+static __noinline __flatten const void *my_search(const void *base, size_t n, const void *key) {
+	return bsearch_template(&my_def, base, n, key, NULL);
+}
+
+static __noinline __flatten const void *my_eytzinger_search(const void *base, size_t n, const void *key) {
+	return bsearch_template(&my_eytzinger_def, base, n, key, NULL);
+}
+
+static __noinline __flatten const void *my_btree_search(const void *base, size_t n, const void *key) {
+	return bsearch_template(&my_btree_def, base, n, key, NULL);
+}
+
+static const struct {
+	const char *desc;
+	const struct qsort_def *def;
+	search_fn_t fn;
+} searches[] = {
+	{"bsearch", &my_def, libc_search},
+	{"bsearch_template", &my_def, my_search},
+	{"bsearch_template (eytzinger)", &my_eytzinger_def, my_eytzinger_search},
+	{"bsearch_template (btree)", &my_btree_def, my_btree_search},
+};
+#define SEARCHES_COUNT (sizeof(searches) / sizeof(*searches))
+
+/* lay out sorted for searches[i], which needs a flatten'd caller too */
+static __noinline __flatten void my_layout(size_t i, const void *sorted,
+					   void *dst, size_t n) {
+	if (searches[i].def == &my_eytzinger_def)
+		search_layout_template(&my_eytzinger_def, sorted, dst, n);
+	else if (searches[i].def == &my_btree_def)
+		search_layout_template(&my_btree_def, sorted, dst, n);
+	else
+		search_layout_template(&my_def, sorted, dst, n);
+}
+
+/* found must be want, or at least an element with the same key */
+#define CHECK_SAME(found, want, what)					\
+	do {								\
+		const void *_f = (found), *_w = (want);			\
+		if (!_f != !_w || (_f && my_key(_f) != my_key(_w)))	\
+			fatal_error("%s wrong for key %lu of %lu", what, i, n); \
+	} while (0)
+
+/* lower bound and upper bound too, in every layout, on small arrays that
+ * include runs of equal keys */
+static __noinline __flatten void check_bounds(void) {
+	enum { N = 1000 };
+	alignas(ALIGN_SIZE) char sorted[N * ELEM_SIZE];
+	alignas(ALIGN_SIZE) char ey[N * ELEM_SIZE];
+	alignas(ALIGN_SIZE) char bt[(N + 64) * ELEM_SIZE];
+	alignas(ALIGN_SIZE) char key[ELEM_SIZE];
+	size_t i, n;
+
+	for (n = 0; n <= N; n = n ? n * 3 + 1 : 1) {
+		for (i = 0; i < n; ++i)
+			my_set_key(sorted + i * ELEM_SIZE, i / 3 * 2 + 1);
+		search_layout_template(&my_eytzinger_def, sorted, ey, n);
+		search_layout_template(&my_btree_def, sorted, bt, n);
+
+		for (i = 0; i < 2 * n / 3 + 3; ++i) {
+			const char *end = sorted + n * ELEM_SIZE;
+			const char *lb, *ub;
+
+			my_set_key(key, i);
+			lb = lower_bound_template(&my_def, sorted, n, key, NULL);
+			ub = upper_bound_template(&my_def, sorted, n, key, NULL);
+
+			/* the element before each bound is on the other side */
+			if ((lb && my_less(lb, key, NULL))
+			    || ((lb ? lb : end) != sorted
+				&& !my_less((lb ? lb : end) - ELEM_SIZE, key, NULL)))
+				fatal_error("lower_bound_template wrong for key %lu of %lu", i, n);
+			if ((ub && !my_less(key, ub, NULL))
+			    || ((ub ? ub : end) != sorted
+				&& my_less(key, (ub ? ub : end) - ELEM_SIZE, NULL)))
+				fatal_error("upper_bound_template wrong for key %lu of %lu", i, n);
+
+			CHECK_SAME(lower_bound_template(&my_eytzinger_def, ey, n, key, NULL), lb, "eytzinger lower bound");
+			CHECK_SAME(upper_bound_template(&my_eytzinger_def, ey, n, key, NULL), ub, "eytzinger upper bound");
+			CHECK_SAME(lower_bound_template(&my_btree_def, bt, n, key, NULL), lb, "btree lower bound");
+			CHECK_SAME(upper_bound_template(&my_btree_def, bt, n, key, NULL), ub, "btree upper bound");
+			CHECK_SAME(bsearch_template(&my_btree_def, bt, n, key, NULL),
+				   lb && !my_less(key, lb, NULL) ? lb : NULL, "btree bsearch");
+		}
+	}
+}
+
+/* keeps the timed searches from being optimized away */
+static volatile size_t total_found;
+
+int main(int argc, char **argv) {
+	size_t max_bytes = argc > 1 ? strtoul(argv[1], NULL, 0) : MAX_BYTES;
+	size_t lookups = argc > 2 ? strtoul(argv[2], NULL, 0) : LOOKUPS;
+	unsigned test_count = argc > 3 ? strtoul(argv[3], NULL, 0) : TEST_COUNT;
+	const size_t max_n = max_bytes / ELEM_SIZE;
+	const void **want;
+	char *sorted, *laid_out, *keys;
+	size_t bytes, i, j;
+
+	check_bounds();
+
+	sorted = aligned_alloc(ALIGN_SIZE, max_n * ELEM_SIZE);
+	/* B-tree nodes each in one cache line */
+	laid_out = aligned_alloc(_QSORT_BTREE_NODE, search_layout_size(&my_btree_def, max_n));
+	keys = aligned_alloc(ALIGN_SIZE, lookups * ELEM_SIZE);
+	want = malloc(lookups * sizeof(*want));
+	if (unlikely(!sorted || !laid_out || !keys || !want)) {
+		errno = ENOMEM;
+		fatal_error("malloc %lu bytes\n", max_n * ELEM_SIZE);
+	}
+
+	printf("elem_size = %lu, min_align = %lu, lookups = %lu, repeat_count = %u\n",
+	       (size_t)ELEM_SIZE, (size_t)ALIGN_SIZE, lookups, test_count);
+	printf("bytes, n, variant, ns/lookup\n");
+
+	for (bytes = MIN_BYTES; bytes <= max_bytes; bytes *= 4) {
+		const size_t n = bytes / ELEM_SIZE;
+
+		/* distinct odd keys, so that even ones miss */
+		for (i = 0; i < n; ++i)
+			my_set_key(sorted + i * ELEM_SIZE, 2 * i + 1);
+		randomize(keys, lookups, ELEM_SIZE, n);
+		for (i = 0; i < lookups; ++i)
+			my_set_key(keys + i * ELEM_SIZE,
+				   my_key(keys + i * ELEM_SIZE) % (2 * n + 1));
+
+		for (i = 0; i < lookups; ++i)
+			want[i] = libc_search(sorted, n, keys + i * ELEM_SIZE);
+
+		for (i = 0; i < SEARCHES_COUNT; ++i) {
+			double t = 0.;
+			unsigned r;
+
+			my_layout(i, sorted, laid_out, n);
+
+			for (r = 0; r < test_count; ++r) {
+				struct timespec start, end;
+				size_t found = 0;
+
+				timespec_set(&start);
+				for (j = 0; j < lookups; ++j)
+					found += !!searches[i].fn(laid_out, n, keys + j * ELEM_SIZE);
+				timespec_set(&end);
+				t += elapsed(start, end);
+				total_found += found;
+			}
+
+			for (j = 0; j < lookups; ++j) {
+				const void *got = searches[i].fn(laid_out, n, keys + j * ELEM_SIZE);
+
+				if (!got != !want[j] || (got && my_key(got) != my_key(want[j])))
+					fatal_error("%s: wrong result for key %lu at %lu bytes",
+						    searches[i].desc, (size_t)my_key(keys + j * ELEM_SIZE), bytes);
+			}
+
+			printf("%lu, %lu, %s, %.2f\n", bytes, n, searches[i].desc,
+			       t * 1e9 / ((double)lookups * test_count));
+		}
+	}
+
+	free(want);
+	free(keys);
+	free(laid_out);
+	free(sorted);
+	return 0;
+}
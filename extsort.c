@@ -0,0 +1,194 @@
+/*
+ * extsort - sort a file of fixed size records with extsort_template
+ * Copyright (C) 2014 Daniel Santos <daniel.santos@pobox.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/* usage: extsort [-m mem_mb] [-T tmpdir] in_file out_file
+ *        extsort -c file
+ *        extsort -g record_count file
+ *
+ * Records are RECORD_SIZE bytes, ordered by a native-endian unsigned 64-bit
+ * key at their start. The first form sorts in_file into out_file (which may
+ * be the same file) and prints the elapsed time and throughput, the second
+ * checks that a file is sorted and the third writes a file of random
+ * records. */
+
+#define  _ISOC11_SOURCE
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <error.h>
+
+#include "extsort.h"
+#include "utils.h"
+
+#ifndef RECORD_SIZE
+# define RECORD_SIZE 16
+#endif
+
+static __always_inline int my_less(const void *a, const void *b, void *context) {
+	uint64_t _a, _b;
+
+	memcpy(&_a, a, sizeof(_a));
+	memcpy(&_b, b, sizeof(_b));
+	return _a < _b;
+}
+
+static const struct qsort_def my_def = {
+	.size = RECORD_SIZE,
+	.align = 1,
+	.less = my_less,
+};
+
+static __noinline __flatten int my_extsort(const char *in, const char *out,
+					   const struct extsort_params *params) {
+	return extsort_template(&my_def, in, out, params, NULL);
+}
+
+static int check_file(const char *path) {
+	char prev[RECORD_SIZE], cur[RECORD_SIZE];
+	size_t i;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (!f)
+		fatal_error("%s", path);
+
+	if (fread(prev, RECORD_SIZE, 1, f) != 1) {
+		fclose(f);
+		return 0;
+	}
+
+	for (i = 1; fread(cur, RECORD_SIZE, 1, f) == 1; ++i) {
+		if (my_less(cur, prev, NULL)) {
+			fprintf(stderr, "%s: not sorted at record %lu\n", path, i);
+			fclose(f);
+			return 1;
+		}
+		memcpy(prev, cur, RECORD_SIZE);
+	}
+
+	if (ferror(f))
+		fatal_error("%s", path);
+	fclose(f);
+	return 0;
+}
+
+static void generate_file(const char *path, size_t n) {
+	const size_t chunk = (16 << 20) / RECORD_SIZE;
+	unsigned seed = 0;
+	char *buf;
+	FILE *f;
+
+	buf = malloc(chunk * RECORD_SIZE);
+	if (!buf) {
+		errno = ENOMEM;
+		fatal_error("malloc %lu bytes\n", chunk * RECORD_SIZE);
+	}
+
+	f = fopen(path, "wb");
+	if (!f)
+		fatal_error("%s", path);
+
+	while (n) {
+		const size_t recs = min(n, chunk);
+
+		randomize(buf, recs, RECORD_SIZE, seed++);
+		if (fwrite(buf, RECORD_SIZE, recs, f) != recs)
+			fatal_error("%s", path);
+		n -= recs;
+	}
+
+	if (fclose(f))
+		fatal_error("%s", path);
+	free(buf);
+}
+
+static void usage(const char *argv0) {
+	fprintf(stderr, "usage: %s [-m mem_mb] [-T tmpdir] in_file out_file\n"
+			"       %s -c file\n"
+			"       %s -g record_count file\n", argv0, argv0, argv0);
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+	struct extsort_params params = {0, NULL};
+	struct timespec start, end, elapsed;
+	const char *check = NULL;
+	size_t generate = 0;
+	struct stat st;
+	double secs;
+	int opt, ret;
+
+	while ((opt = getopt(argc, argv, "m:T:c:g:")) != -1) {
+		switch (opt) {
+		case 'm':
+			params.mem = strtoul(optarg, NULL, 0) << 20;
+			break;
+		case 'T':
+			params.tmpdir = optarg;
+			break;
+		case 'c':
+			check = optarg;
+			break;
+		case 'g':
+			generate = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (check)
+		return check_file(check);
+
+	if (generate) {
+		if (argc - optind != 1)
+			usage(argv[0]);
+		generate_file(argv[optind], generate);
+		return 0;
+	}
+
+	if (argc - optind != 2)
+		usage(argv[0]);
+
+	if (stat(argv[optind], &st))
+		fatal_error("%s", argv[optind]);
+
+	timespec_set(&start);
+	ret = my_extsort(argv[optind], argv[optind + 1], &params);
+	timespec_set(&end);
+
+	if (ret) {
+		errno = ret;
+		fatal_error("sorting %s", argv[optind]);
+	}
+
+	elapsed = timespec_subtract(end, start);
+	secs = elapsed.tv_sec + elapsed.tv_nsec / 1000000000.;
+	printf("records = %lu, record_size = %lu, mem = %lu MiB, time = %.3f s, %.1f MiB/s\n",
+	       (size_t)st.st_size / RECORD_SIZE, (size_t)RECORD_SIZE,
+	       (params.mem ? params.mem : _EXTSORT_DEFAULT_MEM) >> 20, secs,
+	       secs > 0. ? st.st_size / secs / (1 << 20) : 0.);
+	return 0;
+}
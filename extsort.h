@@ -0,0 +1,385 @@
+/*
+ * extsort.h - external (out-of-core) sort of fixed size records in files
+ * Copyright (C) 2014 Daniel Santos <daniel.santos@pobox.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/* A file of def->size byte records is sorted in two phases. First it is read
+ * a memory budget's worth at a time, each chunk sorted with qsort_template
+ * and written out as a sorted run to an (already unlinked) temporary file.
+ * Then the runs are merged with merge_k_template's loser tree, each run and
+ * the output getting an equal share of the budget as a buffer so that all I/O
+ * is large and sequential. If there are too many runs to give each a buffer
+ * of at least _EXTSORT_MIN_BUF bytes, groups of them are merged into longer
+ * runs first. A file that fits in the budget is just read, sorted and written.
+ *
+ * The output is only opened once the input has been read in full, so a file
+ * may be sorted onto itself.
+ */
+
+#ifndef _EXTSORT_H_
+#define _EXTSORT_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "qsort.h"
+
+/* Memory budget used when none is given. */
+#ifndef _EXTSORT_DEFAULT_MEM
+# define _EXTSORT_DEFAULT_MEM ((size_t)256 << 20)
+#endif
+
+/* Smallest buffer a run being merged may have; fewer, larger reads beat a
+ * wider merge. */
+#ifndef _EXTSORT_MIN_BUF
+# define _EXTSORT_MIN_BUF ((size_t)1 << 20)
+#endif
+
+/**
+ * struct extsort_params - tunables for extsort_template
+ * @mem:    memory budget in bytes, or zero for _EXTSORT_DEFAULT_MEM
+ * @tmpdir: directory for temporary runs, or NULL for $TMPDIR or /tmp
+ */
+struct extsort_params {
+	size_t mem;
+	const char *tmpdir;
+};
+
+/* a sorted run in a temporary file and its merge buffer */
+struct extsort_run {
+	int fd;
+	off_t off;		/* next byte to read */
+	size_t remaining;	/* records not yet read into buf */
+	char *buf;
+};
+
+/* read or write all of count bytes at off; returns zero or an errno value */
+static inline int extsort_pread(int fd, void *buf, size_t count, off_t off) {
+	while (count) {
+		ssize_t ret = pread(fd, buf, count, off);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return ret ? errno : EIO;
+		buf = (char *)buf + ret;
+		count -= ret;
+		off += ret;
+	}
+	return 0;
+}
+
+static inline int extsort_write(int fd, const void *buf, size_t count) {
+	while (count) {
+		ssize_t ret = write(fd, buf, count);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return errno;
+		buf = (const char *)buf + ret;
+		count -= ret;
+	}
+	return 0;
+}
+
+/* create an anonymous temporary file; returns the fd or -1 */
+static inline int extsort_tmpfile(const char *tmpdir) {
+	char path[4096];
+	int fd;
+
+	if (!tmpdir)
+		tmpdir = getenv("TMPDIR");
+	if (!tmpdir)
+		tmpdir = "/tmp";
+
+	if (snprintf(path, sizeof(path), "%s/extsort.XXXXXX", tmpdir)
+	    >= (int)sizeof(path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	fd = mkstemp(path);
+	if (fd >= 0)
+		unlink(path);
+	return fd;
+}
+
+/* refill a run's buffer and point its merge cursor at it; returns zero or an
+ * errno value */
+static inline int extsort_run_fill(struct extsort_run *run,
+				   struct _merge_k_cursor *c, size_t size,
+				   size_t buf_recs) {
+	const size_t recs = min(run->remaining, buf_recs);
+	int ret = extsort_pread(run->fd, run->buf, recs * size, run->off);
+
+	run->off       += recs * size;
+	run->remaining -= recs;
+	c->cur          = run->buf;
+	c->end          = run->buf + recs * size;
+	return ret;
+}
+
+/*
+ * _extsort_merge -- merge k runs into out_fd through a loser tree
+ * runs:        the runs, with their buffers assigned
+ * buf_recs:    records per run buffer
+ * out:         output buffer of out_recs records
+ *
+ * The tree is merge_k_template's, with each run's buffer refilled as it
+ * empties. Returns zero or an errno value.
+ */
+static __always_inline int
+_extsort_merge(const struct qsort_def *def, struct extsort_run *runs, int k,
+	       size_t buf_recs, int out_fd, char *out, size_t out_recs,
+	       void *arg) {
+	const size_t size = def->size;
+	char *const out_end = out + out_recs * size;
+	struct _merge_k_cursor *c;
+	char *o = out;
+	struct _merge_k_node *tree;
+	int i, ret = 0;
+
+	/* cursors and the tree; exhausted runs stay in it, so the caller still
+	 * has to close them all */
+	c = malloc((sizeof(*c) + sizeof(*tree)) * k);
+	if (!c)
+		return ENOMEM;
+	tree = (struct _merge_k_node *)(c + k);
+
+	for (i = 0; i < k && !ret; ++i)
+		ret = extsort_run_fill(&runs[i], &c[i], size, buf_recs);
+	if (ret)
+		goto out_free;
+
+	/* runs are never empty, so neither are the cursors */
+	_merge_k_build(def, c, tree, k, arg);
+
+	/* the winner has no element only once every run is exhausted */
+	while (tree[0].elem && !ret) {
+		const int w = tree[0].input;
+
+		_quicksort_copy(def, o, c[w].cur);
+		o += size;
+		if (o == out_end) {
+			ret = extsort_write(out_fd, out, o - out);
+			o = out;
+		}
+
+		c[w].cur += size;
+		if (c[w].cur == c[w].end && runs[w].remaining)
+			ret = extsort_run_fill(&runs[w], &c[w], size, buf_recs);
+		_merge_k_adjust(def, tree, k,
+				_merge_k_load(def, c[w].cur != c[w].end
+						   ? c[w].cur : NULL, w, arg),
+				arg);
+	}
+
+	if (!ret && o != out)
+		ret = extsort_write(out_fd, out, o - out);
+
+out_free:
+	free(c);
+	return ret;
+}
+
+/**
+ * extsort_template - sort a file of fixed size records
+ * @def:      the template parameters; def->size is the record size
+ * @in_path:  file to sort, which must be a whole number of records long
+ * @out_path: where to write the result (may be in_path)
+ * @params:   memory budget and temporary directory, or NULL for defaults
+ * @arg:      passed to def->less
+ *
+ * Returns zero on success, EINVAL if the input isn't a whole number of
+ * records or the budget can't hold two of them, ENOMEM, or the errno value
+ * of a failed system call.
+ */
+static __always_inline __flatten int
+extsort_template (const struct qsort_def *def, const char *in_path,
+                  const char *out_path, const struct extsort_params *params,
+                  void *arg)
+{
+  const size_t size = def->size;
+  const size_t align = min (def->align, _QSORT_ALIGN_MAX) < _Alignof (void *)
+                       ? _Alignof (void *) : min (def->align, _QSORT_ALIGN_MAX);
+  const size_t mem = params && params->mem ? params->mem : _EXTSORT_DEFAULT_MEM;
+  const char *tmpdir = params ? params->tmpdir : NULL;
+  /* the index qsort_template sorts large records through comes out of the
+     budget too */
+  const size_t rec_cost = size + _quicksort_index_entry_size (
+                                   _quicksort_indirect_mode (def));
+  struct qsort_ctx ctx = QSORT_CTX_INIT;
+  struct extsort_run *runs = NULL;
+  size_t nruns = 0;
+  size_t chunk_recs, total_recs, done;
+  char *buf = NULL;
+  int in_fd, out_fd = -1;
+  struct stat st;
+  int ret = 0;
+  size_t i;
+
+  in_fd = open (in_path, O_RDONLY);
+  if (in_fd < 0)
+    return errno;
+
+  if (fstat (in_fd, &st))
+    {
+      ret = errno;
+      goto out_close;
+    }
+
+  total_recs = st.st_size / size;
+  chunk_recs = mem / rec_cost;
+  if (st.st_size % size || chunk_recs < 2)
+    {
+      ret = EINVAL;
+      goto out_close;
+    }
+  if (chunk_recs > total_recs)
+    chunk_recs = total_recs ? total_recs : 1;
+
+  buf = aligned_alloc (align, (chunk_recs * size + align - 1) & ~(align - 1));
+  if (!buf)
+    {
+      ret = ENOMEM;
+      goto out_close;
+    }
+
+  /* phase 1: sorted runs */
+  for (done = 0; done < total_recs; done += chunk_recs)
+    {
+      const size_t recs = min (chunk_recs, total_recs - done);
+      struct extsort_run *r;
+
+      ret = extsort_pread (in_fd, buf, recs * size, done * size);
+      if (!ret)
+        ret = qsort_ctx_template (def, &ctx, buf, recs, arg);
+      if (ret)
+        goto out_free;
+
+      /* it all fit: no runs needed */
+      if (recs == total_recs)
+        break;
+
+      r = realloc (runs, sizeof (*runs) * (nruns + 1));
+      if (!r)
+        {
+          ret = ENOMEM;
+          goto out_free;
+        }
+      runs = r;
+      runs[nruns].fd = extsort_tmpfile (tmpdir);
+      if (runs[nruns].fd < 0)
+        {
+          ret = errno;
+          goto out_free;
+        }
+      runs[nruns].off = 0;
+      runs[nruns].remaining = recs;
+      ++nruns;
+
+      ret = extsort_write (runs[nruns - 1].fd, buf, recs * size);
+      if (ret)
+        goto out_free;
+    }
+  qsort_ctx_destroy (&ctx);
+
+  /* phase 2: merge, narrowing down to as many runs as the budget allows */
+  while (nruns)
+    {
+      const size_t budget_recs = chunk_recs;  /* buf is reused for merging */
+      size_t fan_in = mem / _EXTSORT_MIN_BUF - 1;
+      size_t k, buf_recs, merged;
+      int fd;
+
+      if (fan_in < 2)
+        fan_in = 2;
+      k = min (nruns, fan_in);
+      buf_recs = budget_recs / (k + 1);
+      if (!buf_recs)
+        {
+          ret = EINVAL;
+          goto out_free;
+        }
+
+      for (i = 0, merged = 0; i < k; ++i)
+        {
+          runs[i].buf = buf + i * buf_recs * size;
+          merged += runs[i].remaining;
+        }
+
+      if (k == nruns)
+        fd = out_fd = open (out_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+      else
+        fd = extsort_tmpfile (tmpdir);
+      if (fd < 0)
+        {
+          ret = errno;
+          goto out_free;
+        }
+
+      ret = _extsort_merge (def, runs, k, buf_recs, fd,
+                            buf + k * buf_recs * size, buf_recs, arg);
+
+      for (i = 0; i < k; ++i)
+        close (runs[i].fd);
+      nruns -= k;
+      memmove (runs, runs + k, sizeof (*runs) * nruns);
+
+      if (fd == out_fd)
+        break;
+
+      /* the merged run goes to the back of the queue */
+      runs[nruns].fd = fd;
+      runs[nruns].off = 0;
+      runs[nruns].remaining = merged;
+      ++nruns;
+
+      if (ret)
+        goto out_free;
+    }
+
+  /* everything fit in one chunk */
+  if (out_fd < 0 && !ret)
+    {
+      out_fd = open (out_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+      if (out_fd < 0)
+        ret = errno;
+      else
+        ret = extsort_write (out_fd, buf, total_recs * size);
+    }
+
+out_free:
+  qsort_ctx_destroy (&ctx);
+  for (i = 0; i < nruns; ++i)
+    close (runs[i].fd);
+  free (runs);
+  free (buf);
+  if (out_fd >= 0 && close (out_fd) && !ret)
+    ret = errno;
+out_close:
+  close (in_fd);
+  return ret;
+}
+
+#endif /* _EXTSORT_H_ */
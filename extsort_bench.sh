@@ -0,0 +1,55 @@
+#!/bin/bash
+
+# extsort_bench.sh - builds extsort and times it on large random files
+# Copyright (C) 2014 Daniel Santos <daniel.santos@pobox.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software Foundation,
+# Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+
+# File sizes in GiB and memory budgets in MiB to test; the files go in DIR,
+# which should be on a local disk with room for three times the largest, e.g.
+# DIR=/scratch FILE_GIB="1 4" MEM_MIB="256" ./extsort_bench.sh
+FILE_GIB="${FILE_GIB:-1 2 4 8}"
+MEM_MIB="${MEM_MIB:-64 256 1024}"
+RECORD_SIZES="${RECORD_SIZES:-16 100}"
+DIR="${DIR:-/var/tmp}"
+
+CFLAGS="-std=gnu11 -march=native -g3 -pipe -Wall -Wextra -Wcast-align -Wno-unused-parameter -O2 -DNDEBUG"
+
+die() {
+	echo "ERROR: $*" >&2
+	exit 1
+}
+
+in="${DIR}/extsort_bench.in"
+out="${DIR}/extsort_bench.out"
+trap 'rm -f "${in}" "${out}"' EXIT
+
+for rs in ${RECORD_SIZES}; do
+	gcc ${CFLAGS} -DRECORD_SIZE=${rs} -o extsort_${rs} extsort.c ||
+		die "build failed"
+
+	for gib in ${FILE_GIB}; do
+		./extsort_${rs} -g $(( (gib << 30) / rs )) "${in}" ||
+			die "writing ${in}"
+		sync
+
+		for mem in ${MEM_MIB}; do
+			echo -n "record_size = ${rs}, file = ${gib} GiB: "
+			./extsort_${rs} -m ${mem} -T "${DIR}" "${in}" "${out}" ||
+				die "extsort failed"
+			./extsort_${rs} -c "${out}" || die "output not sorted"
+		done
+	done
+done
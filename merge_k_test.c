@@ -0,0 +1,206 @@
+/*
+ * merge_k_test - benchmark for merge_k_template
+ * Copyright (C) 2014 Daniel Santos <daniel.santos@pobox.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/* usage: merge_k_test [num_elems [max_k [repeat_count]]]
+ *
+ * Splits num_elems random elements into k sorted arrays for k = 2, 4, ...
+ * max_k, then merges them with merge_k_template (copying and emitting
+ * indices) and, for comparison, concatenates them and sorts the lot with
+ * qsort_template. Prints the time and throughput of each as CSV. */
+
+#define  _ISOC11_SOURCE
+#define _GNU_SOURCE
+
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <error.h>
+#include <assert.h>
+
+#include "qsort.h"
+#include "utils.h"
+#include "test_elem.h"
+
+#ifndef NUM_ELEMS
+# define NUM_ELEMS (4 * 1024 * 1024)
+#endif
+
+#ifndef MAX_K
+# define MAX_K 256
+#endif
+
+static const struct qsort_def my_def = {
+	.size = ELEM_SIZE,
+	.align = ALIGN_SIZE,
+	.less = my_less,
+};
+
+/* the merges carry my_less's key in the loser tree */
+static const struct qsort_def my_merge_def = {
+	.size = ELEM_SIZE,
+	.align = ALIGN_SIZE,
+	.less = my_less,
+	.key_width = MY_KEY_WIDTH,
+	.key_type = QSORT_KEY_UNSIGNED,
+};
+
+static const struct qsort_def my_index_def = {
+	.size = ELEM_SIZE,
+	.align = ALIGN_SIZE,
+	.less = my_less,
+	.key_width = MY_KEY_WIDTH,
+	.key_type = QSORT_KEY_UNSIGNED,
+	.merge_index = 1,
+};
+
+static __noinline __flatten int my_sort(void *p, size_t n) {
+	return qsort_template(&my_def, p, n, NULL);
+}
+
+static __noinline __flatten int my_merge(const void *const *inputs,
+					 const size_t *lengths, size_t k,
+					 void *out) {
+	return merge_k_template(&my_merge_def, inputs, lengths, k, out, NULL);
+}
+
+static __noinline __flatten int my_merge_index(const void *const *inputs,
+					       const size_t *lengths, size_t k,
+					       void *out) {
+	return merge_k_template(&my_index_def, inputs, lengths, k, out, NULL);
+}
+
+/* the arrays are contiguous in src, so concatenating them is one copy */
+static __noinline int concat_sort(const void *src, size_t n, void *out) {
+	memcpy(out, src, n * ELEM_SIZE);
+	return my_sort(out, n);
+}
+
+static void check_sorted(const char *p, size_t n, uint64_t hash,
+			 const char *desc, size_t k) {
+	size_t i;
+
+	for (i = 1; i < n; ++i)
+		if (my_less(p + i * ELEM_SIZE, p + (i - 1) * ELEM_SIZE, NULL))
+			fatal_error("%s: not sorted at %lu with k = %lu", desc, i, k);
+
+	if (multiset_hash(p, n, ELEM_SIZE) != hash)
+		fatal_error("%s: not a permutation of the input with k = %lu",
+			    desc, k);
+}
+
+/* positions must be a stable ordering of the concatenation src */
+static void check_index(const char *src, const size_t *index, size_t n,
+			size_t k) {
+	size_t i;
+
+	for (i = 1; i < n; ++i) {
+		const char *a = src + index[i - 1] * ELEM_SIZE;
+		const char *b = src + index[i] * ELEM_SIZE;
+
+		if (index[i] >= n || my_less(b, a, NULL)
+		    || (!my_less(a, b, NULL) && index[i] < index[i - 1]))
+			fatal_error("merge_k_template (index): bad at %lu with k = %lu", i, k);
+	}
+}
+
+int main(int argc, char **argv) {
+	size_t n = argc > 1 ? strtoul(argv[1], NULL, 0) : NUM_ELEMS;
+	size_t max_k = argc > 2 ? strtoul(argv[2], NULL, 0) : MAX_K;
+	unsigned test_count = argc > 3 ? strtoul(argv[3], NULL, 0) : TEST_COUNT;
+	const void **inputs;
+	size_t *lengths;
+	size_t k, i;
+	char *src;
+	void *out;
+
+	src = aligned_alloc(ALIGN_SIZE, n * ELEM_SIZE);
+	/* also holds the index output */
+	out = aligned_alloc(ALIGN_SIZE < _Alignof(size_t) ? _Alignof(size_t) : ALIGN_SIZE,
+			    n * (ELEM_SIZE < sizeof(size_t) ? sizeof(size_t) : ELEM_SIZE));
+	inputs = malloc(max_k * sizeof(*inputs));
+	lengths = malloc(max_k * sizeof(*lengths));
+	if (unlikely(!src || !out || !inputs || !lengths)) {
+		errno = ENOMEM;
+		fatal_error("malloc %lu bytes\n", n * ELEM_SIZE);
+	}
+
+	printf("n = %lu, elem_size = %lu, min_align = %lu, repeat_count = %u\n",
+	       n, (size_t)ELEM_SIZE, (size_t)ALIGN_SIZE, test_count);
+	printf("k, variant, time, elems/sec\n");
+
+	for (k = 2; k <= max_k; k *= 2) {
+		double t_merge = 0., t_index = 0., t_sort = 0.;
+
+		for (i = 0; i < k; ++i) {
+			inputs[i] = src + n / k * i * ELEM_SIZE;
+			lengths[i] = i + 1 < k ? n / k : n - n / k * i;
+		}
+
+		for (i = 0; i < test_count; ++i) {
+			struct timespec start, end;
+			uint64_t hash;
+			size_t j;
+
+			randomize(src, n, ELEM_SIZE, i);
+			hash = multiset_hash(src, n, ELEM_SIZE);
+			for (j = 0; j < k; ++j)
+				if (my_sort((void *)inputs[j], lengths[j]))
+					fatal_error("my_sort");
+
+			timespec_set(&start);
+			if (my_merge(inputs, lengths, k, out))
+				fatal_error("merge_k_template");
+			timespec_set(&end);
+			t_merge += elapsed(start, end);
+			check_sorted(out, n, hash, "merge_k_template", k);
+
+			timespec_set(&start);
+			if (my_merge_index(inputs, lengths, k, out))
+				fatal_error("merge_k_template (index)");
+			timespec_set(&end);
+			t_index += elapsed(start, end);
+			check_index(src, out, n, k);
+
+			timespec_set(&start);
+			if (concat_sort(src, n, out))
+				fatal_error("qsort_template");
+			timespec_set(&end);
+			t_sort += elapsed(start, end);
+			check_sorted(out, n, hash, "concat + qsort_template", k);
+		}
+
+		printf("%lu, merge_k_template, %.6f, %.0f\n", k,
+		       t_merge / test_count, n * test_count / t_merge);
+		printf("%lu, merge_k_template (index), %.6f, %.0f\n", k,
+		       t_index / test_count, n * test_count / t_index);
+		printf("%lu, concat + qsort_template, %.6f, %.0f\n", k,
+		       t_sort / test_count, n * test_count / t_sort);
+	}
+
+	free(lengths);
+	free(inputs);
+	free(out);
+	free(src);
+	return 0;
+}
@@ -37,7 +37,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <errno.h>
 #include <assert.h>
+#include <time.h>
 
 #if __STDC_VERSION__ >= 201112L
 # include <stdalign.h>
@@ -71,6 +73,199 @@ extern void _quicksort (void *const pbase, size_t total_elems, size_t size,
 # define _QSORT_IND_THRESH 64
 #endif
 
+/* Values of the indirect parameter taken by the helpers: the elements being
+ * sorted are either the data itself, pointers to it, (when max_size_bits
+ * allows) 32-bit element numbers relative to qsort_def::ind_base or (with
+ * qsort_def::prefix_cache) struct _quicksort_prefixed. */
+#define _QSORT_DIRECT		0
+#define _QSORT_INDIRECT_PTR	1
+#define _QSORT_INDIRECT_OFF32	2
+#define _QSORT_INDIRECT_PREFIX	3
+
+/* Number of elements examined per offset block by the block partition. Must
+ * not exceed 255 so that offsets (the right ones stored biased by one) fit in
+ * an unsigned char. */
+#ifndef _QSORT_BLOCK_SIZE
+# define _QSORT_BLOCK_SIZE 64
+#endif
+
+/* Maximum number of element moves a partial insertion sort may make before
+ * giving up on a partition that looked sorted. */
+#ifndef _QSORT_PARTIAL_INSERTION_LIMIT
+# define _QSORT_PARTIAL_INSERTION_LIMIT 8
+#endif
+
+/**
+ * enum qsort_partition - partitioning kernels available to qsort_template
+ * @QSORT_PARTITION_HOARE: glibc's "collapse the walls" loop (the default)
+ * @QSORT_PARTITION_BLOCK: branchless block partition (BlockQuicksort) with
+ *                         pdqsort's pattern breaking and partial insertion
+ *                         sort bailout for nearly sorted partitions
+ * @QSORT_PARTITION_THREE_WAY: Bentley-McIlroy "fat pivot" partition, which
+ *                         gathers keys equal to the pivot in the middle and
+ *                         never recurses into them
+ */
+enum qsort_partition {
+	QSORT_PARTITION_HOARE = 0,
+	QSORT_PARTITION_BLOCK,
+	QSORT_PARTITION_THREE_WAY,
+};
+
+/**
+ * enum qsort_pivot - how qsort_template picks a partition's pivot
+ * @QSORT_PIVOT_MEDIAN3:  median of the first, middle and last elements (the
+ *                        default)
+ * @QSORT_PIVOT_NINTHER:  Tukey's ninther (median of the medians of three
+ *                        evenly spread triples) for partitions of at least
+ *                        _QSORT_NINTHER_THRESH elements
+ * @QSORT_PIVOT_ADAPTIVE: as QSORT_PIVOT_NINTHER, but the median of about
+ *                        sqrt(n) evenly spread samples for partitions of at
+ *                        least _QSORT_SAMPLE_THRESH elements
+ */
+enum qsort_pivot {
+	QSORT_PIVOT_MEDIAN3 = 0,
+	QSORT_PIVOT_NINTHER,
+	QSORT_PIVOT_ADAPTIVE,
+};
+
+/* Smallest partition whose pivot is a ninther (qsort_def::pivot). */
+#ifndef _QSORT_NINTHER_THRESH
+# define _QSORT_NINTHER_THRESH 128
+#endif
+
+/* Smallest partition whose pivot is the median of a sqrt(n) sample
+ * (QSORT_PIVOT_ADAPTIVE). */
+#ifndef _QSORT_SAMPLE_THRESH
+# define _QSORT_SAMPLE_THRESH (1 << 14)
+#endif
+
+/* Buckets with no more than this many elements are finished off by
+ * qsort_template instead of further radix passes. */
+#ifndef _QSORT_RADIX_THRESH
+# define _QSORT_RADIX_THRESH 64
+#endif
+
+/* Length of the runs that msort_template insertion sorts before merging. */
+#ifndef _QSORT_MSORT_RUN
+# define _QSORT_MSORT_RUN 8
+#endif
+
+/* Shortest run that msort_template's natural merge (qsort_def::adaptive)
+ * will merge; shorter runs are extended by insertion sort. */
+#ifndef _QSORT_MSORT_MINRUN
+# define _QSORT_MSORT_MINRUN 32
+#endif
+
+/* Most elements out of place at the end of an otherwise sorted array that
+ * qsort_template's pre-scan (qsort_def::adaptive) will insert directly. */
+#ifndef _QSORT_PRESORTED_TAIL
+# define _QSORT_PRESORTED_TAIL 8
+#endif
+
+/* Ranges at or below this many elements are insertion sorted to finish a
+ * selection. */
+#ifndef _QSORT_SELECT_THRESH
+# define _QSORT_SELECT_THRESH 16
+#endif
+
+/* Number of groups qsort_batch_template sorts side by side, one per vector
+ * lane, when the group length is a compile-time constant. */
+#ifndef _QSORT_BATCH_LANES
+# define _QSORT_BATCH_LANES 8
+#endif
+
+/* Groups of up to this many elements that can't use a sorting network are
+ * insertion sorted by the batch templates. */
+#ifndef _QSORT_BATCH_INSERTION
+# define _QSORT_BATCH_INSERTION 16
+#endif
+
+/* Bytes swapped per step by _quicksort_swap: a vector register's worth. */
+#ifndef _QSORT_SWAP_CHUNK
+# ifdef __AVX__
+#  define _QSORT_SWAP_CHUNK 32
+# else
+#  define _QSORT_SWAP_CHUNK 16
+# endif
+#endif
+
+/* How many elements ahead of the copy _quicksort_gather prefetches. */
+#ifndef _QSORT_GATHER_PREFETCH
+# define _QSORT_GATHER_PREFETCH 8
+#endif
+
+/* Largest partition that a sorting network sorts in one go. */
+#define _QSORT_NETWORK_MAX 16
+
+/**
+ * enum qsort_key_type - how the bits of a key are to be interpreted
+ * @QSORT_KEY_UNSIGNED: unsigned integer
+ * @QSORT_KEY_SIGNED:   two's complement signed integer
+ * @QSORT_KEY_FLOAT:    IEEE 754 binary32 or binary64 (key_width 4 or 8)
+ */
+enum qsort_key_type {
+	QSORT_KEY_UNSIGNED = 0,
+	QSORT_KEY_SIGNED,
+	QSORT_KEY_FLOAT,
+};
+
+/**
+ * enum qsort_layout - how a sorted array is laid out for searching (see
+ *                     bsearch.h)
+ * @QSORT_LAYOUT_SORTED:    plain sorted order (the default)
+ * @QSORT_LAYOUT_EYTZINGER: an implicit binary tree in breadth first order,
+ *                          the root first and the children of the element
+ *                          at i at 2i + 1 and 2i + 2
+ * @QSORT_LAYOUT_BTREE:     an implicit B-tree of _QSORT_BTREE_NODE byte
+ *                          nodes, in breadth first order
+ */
+enum qsort_layout {
+	QSORT_LAYOUT_SORTED = 0,
+	QSORT_LAYOUT_EYTZINGER,
+	QSORT_LAYOUT_BTREE,
+};
+
+/**
+ * struct qsort_key_col - one column of a compound key (qsort_def::keys)
+ * @offset: offset of the column within each element
+ * @width:  its width in bytes (1 to 8; 4 or 8 for QSORT_KEY_FLOAT)
+ * @type:   how its bits are interpreted, one of enum qsort_key_type
+ * @desc:   non-zero to order this column descending
+ */
+struct qsort_key_col {
+	size_t offset;
+	size_t width;
+	enum qsort_key_type type;
+	int desc;
+};
+
+/**
+ * struct qsort_stats - what a sort did, collected through qsort_def::stats
+ * @compares:    comparisons (calls to less, or of cached key prefixes)
+ * @swaps:       elements (or index entries) swapped
+ * @ror_moves:   elements shifted one place by insertion
+ * @partitions:  partitioning passes
+ * @max_stack:   most stack_node entries in use at once
+ * @index_ns:    nanoseconds spent building the index of an indirect sort
+ * @perm_cycles: cycles followed permuting the array into index order
+ * @partition_elems: elements in each partition partitioned, summed
+ * @partition_minor: elements on the smaller side of each split, summed;
+ *               divided by partition_elems, 0.5 for perfectly even splits
+ *
+ * Counts accumulate from one sort to the next; zero the struct to start over.
+ */
+struct qsort_stats {
+	uint64_t compares;
+	uint64_t swaps;
+	uint64_t ror_moves;
+	uint64_t partitions;
+	uint64_t max_stack;
+	uint64_t index_ns;
+	uint64_t perm_cycles;
+	uint64_t partition_elems;
+	uint64_t partition_minor;
+};
+
 /* struct qsort_def -- pseudo-template definition for _quicksort_template */
 
 
@@ -93,12 +288,18 @@ extern void _quicksort (void *const pbase, size_t total_elems, size_t size,
  * Pointer to an element buffer (should be at least size bytes and alisnged).
  *
  * @var qsort_def::index
- * Pointer to an index buffer when indirect sorting is used.
+ * Pointer to an index buffer when indirect sorting is used. When
+ * max_size_bits is 32 or less, qsort_template only uses n * 4 bytes of it;
+ * with prefix_cache it needs room for 2 * n pointers.
  *
- * @var qsort_def::max_count_bits
+ * @var qsort_def::max_size_bits
  * Maximum number of bits needed to store count of elements. e.g., if
- * max_count_bits is 16, then the qsort will only allocate enough stack and/or
- * heap space to sort arrays with 2^16 - 1 (65535) elements in them.
+ * max_size_bits is 16, then the qsort will only allocate enough stack and/or
+ * heap space to sort arrays with 2^16 - 1 (65535) elements in them. At 32 or
+ * less, qsort_template's partition stack holds 32-bit element numbers rather
+ * than pointers and large elements are sorted through an index of uint32_t
+ * element numbers instead of pointers, halving its size on 64-bit machines.
+ * When max_size_bits is 32 or less, larger arrays are refused with EINVAL.
  *
  * @var qsort_def::max_stack_space
  * The maxiumum number of bytes to put on the stack. If needed space bypasses
@@ -106,6 +307,105 @@ extern void _quicksort (void *const pbase, size_t total_elems, size_t size,
  *
  * @var qsort_def::max_thresh
  *
+ * @var qsort_def::introsort
+ * If non-zero, limit partitioning depth to 2 * log2(n) and heapsort any
+ * partition that exceeds it, bounding the worst case at O(n log n).
+ *
+ * @var qsort_def::partition
+ * Partitioning kernel to use, one of enum qsort_partition. The block kernel
+ * always bounds the number of badly unbalanced partitions to log2(n) before
+ * falling back to heapsort, regardless of introsort.
+ *
+ * @var qsort_def::pivot
+ * Pivot selection, one of enum qsort_pivot.
+ *
+ * @var qsort_def::three_way_adaptive
+ * If non-zero, any partition whose median-of-three sample contains equal keys
+ * is partitioned three ways, whichever kernel is otherwise in use.
+ *
+ * @var qsort_def::key_offset
+ * Offset of the key within each element, for radix_sort_template.
+ *
+ * @var qsort_def::key_width
+ * Width of the key in bytes (1 to 8), or zero if no key is described. The key
+ * is read in native byte order and must order elements the same way as less.
+ *
+ * @var qsort_def::key_type
+ * Interpretation of the key, one of enum qsort_key_type.
+ *
+ * @var qsort_def::network
+ * If non-zero and the key is the entire element (1, 2, 4 or 8 bytes at offset
+ * zero), sort each partition of up to _QSORT_NETWORK_MAX elements with a
+ * branchless sorting network as soon as it is split off, instead of leaving
+ * them to the final insertion sort. Ignored for any other key layout.
+ *
+ * @var qsort_def::merge_buf
+ * Optional scratch space for msort_template: n * size bytes aligned like the
+ * array, or n pointers when elements are large enough to be sorted
+ * indirectly. Allocated (and freed) on each call if NULL.
+ *
+ * @var qsort_def::prefix_cache
+ * If non-zero, qsort_template sorts large elements through an index of
+ * (key prefix, pointer) pairs, comparing the prefixes inline and only calling
+ * less (and so touching the elements) when they are equal. The prefix comes
+ * from the prefix function if supplied, otherwise from the key described by
+ * key_offset, key_width and key_type.
+ *
+ * @var qsort_def::prefix
+ * Optional function returning an element's key prefix: an unsigned integer
+ * such that prefix(a) < prefix(b) implies less(a, b).
+ *
+ * @var qsort_def::adaptive
+ * If non-zero, qsort_template first checks whether the array is already
+ * sorted, strictly descending or sorted but for up to _QSORT_PRESORTED_TAIL
+ * trailing elements, and if so finishes in linear time (plus the insertion of
+ * the tail). msort_template instead merges the natural runs of its input, as
+ * TimSort does.
+ *
+ * @var qsort_def::ind_base
+ * Internal: the real array while sorting an index of 32-bit element numbers.
+ *
+ * @var qsort_def::ind_size
+ * Internal: the real element size while sorting an index of 32-bit element
+ * numbers.
+ *
+ * @var qsort_def::merge_index
+ * If non-zero, merge_k_template writes the position of each element in the
+ * concatenation of its inputs (as a size_t) instead of copying the element.
+ *
+ * @var qsort_def::binary_insertion
+ * If non-zero, insertion sorts find where each element goes by galloping
+ * back from it and then binary searching, instead of stepping back one
+ * element at a time. That takes more comparisons for elements that move
+ * only a place or two, but far fewer for long moves, and pays off when less
+ * is expensive.
+ *
+ * @var qsort_def::copy_dst
+ * Internal: where qsort_copy_template has an indirect sort gather the sorted
+ * elements, leaving the array itself untouched.
+ *
+ * @var qsort_def::stats
+ * Optional struct qsort_stats to count into. When NULL (a compile-time
+ * constant), none of the counting code is generated.
+ *
+ * @var qsort_def::keys
+ * Optional array of nkeys key columns, most significant first, which must
+ * be a compile-time constant (a static const array). QSORT_KEYS_LESS
+ * defines a less that orders elements by them lexicographically. If
+ * prefix_cache is set without a key_width or prefix function, the prefix is
+ * the first 8 bytes of the qsort_key_normalize encoding.
+ *
+ * @var qsort_def::nkeys
+ * Number of columns in keys.
+ *
+ * @var qsort_def::key_normalize
+ * If non-zero, keys are compared through their qsort_key_normalize encoding,
+ * 8 bytes at a time, instead of column by column. That is fewer comparisons
+ * when several columns are narrow (four uint16_t columns are one compare).
+ *
+ * @var qsort_def::layout
+ * Layout of the array searched by bsearch_template and friends, one of enum
+ * qsort_layout. search_layout_template produces it from a sorted array.
  */
 struct qsort_def {
 	size_t size;
@@ -116,8 +416,51 @@ struct qsort_def {
 	size_t max_size_bits;
 	size_t max_stack_space;
 	size_t max_thresh;
+	int introsort;
+	enum qsort_partition partition;
+	enum qsort_pivot pivot;
+	int three_way_adaptive;
+	size_t key_offset;
+	size_t key_width;
+	enum qsort_key_type key_type;
+	int network;
+	void *merge_buf;
+	int prefix_cache;
+	uint64_t (*prefix)(const void *elem, void *context);
+	int adaptive;
+	char *ind_base;
+	size_t ind_size;
+	int merge_index;
+	int binary_insertion;
+	void *copy_dst;
+	struct qsort_stats *stats;
+	const struct qsort_key_col *keys;
+	size_t nkeys;
+	int key_normalize;
+	enum qsort_layout layout;
 };
 
+/* count into def->stats, if there is one */
+#define _QSORT_STAT_ADD(def, field, n)					\
+	do {								\
+		if ((def)->stats)					\
+			(def)->stats->field += (n);			\
+	} while (0)
+
+#define _QSORT_STAT_MAX(def, field, v)					\
+	do {								\
+		if ((def)->stats && (def)->stats->field < (uint64_t)(v))	\
+			(def)->stats->field = (v);			\
+	} while (0)
+
+/* monotonic clock in nanoseconds, for qsort_stats::index_ns */
+static inline uint64_t _quicksort_now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
 #define _ALIGNED_COPY(def, dest, src, align)                            \
 	do {                                                            \
 		void       *d = __builtin_assume_aligned(dest, align);  \
@@ -158,11 +501,52 @@ _quicksort_copy(const struct qsort_def *def, void *dest, const void *src) {
 #undef _ALIGNED_COPY
 
 
+/* swap n bytes at a and b through a pair of registers (or register sized
+ * temporaries) */
+static __always_inline void
+_quicksort_swap_bytes(char *a, char *b, size_t n) {
+	char ta[_QSORT_SWAP_CHUNK], tb[_QSORT_SWAP_CHUNK];
+
+	__builtin_memcpy(ta, a, n);
+	__builtin_memcpy(tb, b, n);
+	__builtin_memcpy(a, tb, n);
+	__builtin_memcpy(b, ta, n);
+}
+
+/* Swaps whole _QSORT_SWAP_CHUNK byte chunks and then the tail in halving
+ * steps. Each step loads both sides before storing either, so elements are
+ * read and written once rather than going through def->elem_buf. */
 static __always_inline void
 _quicksort_swap(const struct qsort_def *def, void *a, void *b) {
-	_quicksort_copy(def, def->elem_buf, a);
-	_quicksort_copy(def, a, b);
-	_quicksort_copy(def, b, def->elem_buf);
+	const size_t size = def->size;
+	char *pa = a;
+	char *pb = b;
+	size_t off = 0;
+
+	assert_const(size);
+	_QSORT_STAT_ADD(def, swaps, 1);
+
+	for (; off + _QSORT_SWAP_CHUNK <= size; off += _QSORT_SWAP_CHUNK)
+		_quicksort_swap_bytes(pa + off, pb + off, _QSORT_SWAP_CHUNK);
+
+	if (_QSORT_SWAP_CHUNK > 16 && size - off >= 16) {
+		_quicksort_swap_bytes(pa + off, pb + off, 16);
+		off += 16;
+	}
+	if (size - off >= 8) {
+		_quicksort_swap_bytes(pa + off, pb + off, 8);
+		off += 8;
+	}
+	if (size - off >= 4) {
+		_quicksort_swap_bytes(pa + off, pb + off, 4);
+		off += 4;
+	}
+	if (size - off >= 2) {
+		_quicksort_swap_bytes(pa + off, pb + off, 2);
+		off += 2;
+	}
+	if (size - off)
+		_quicksort_swap_bytes(pa + off, pb + off, 1);
 }
 
 /*
@@ -188,6 +572,7 @@ _quicksort_ror(const struct qsort_def *def, void *left, void *right) {
 	/* validate distance between pointers is positive */
 	assert(dist != 0);
 	assert(dist > 0);
+	_QSORT_STAT_ADD(def, ror_moves, dist);
 
 	_quicksort_copy(def, def->elem_buf, r);
 
@@ -198,408 +583,3075 @@ _quicksort_ror(const struct qsort_def *def, void *left, void *right) {
 	_quicksort_copy(def, left, def->elem_buf);
 }
 
-static __always_inline __flatten int
-_quicksort_less(const struct qsort_def *def, int indirect, void *a, void *b, void *arg) {
-  return indirect
-       ? def->less(*((void**)a), *((void**)b), arg)
-       : def->less(a, b, arg);
+/*
+ * _quicksort_bits -- extract a key as an unsigned integer that sorts in the
+ *                    same order as the key itself
+ * offset:      byte offset of the key within elem
+ * width:       size of the key in bytes, at most 8
+ * type:        how the key's bytes are to be interpreted
+ *
+ * Signed integers have their sign bit flipped. Negative floats have all of
+ * their bits flipped and positive ones just the sign bit, which orders them
+ * correctly (NaNs aside) by their bit patterns.
+ */
+static __always_inline uint64_t
+_quicksort_bits(const void *elem, size_t offset, size_t width,
+		enum qsort_key_type type) {
+	const uint64_t sign = (uint64_t)1 << (width * CHAR_BIT - 1);
+	const uint64_t mask = sign | (sign - 1);
+	uint64_t k = 0;
+
+	assert_const(width);
+	assert_const(offset);
+	assert_const(type);
+	BUILD_BUG_ON_MSG(width > sizeof(k), "key_width must not exceed 8 bytes");
+	BUILD_BUG_ON_MSG(type == QSORT_KEY_FLOAT && width != 4 && width != 8,
+			 "float keys must be 4 or 8 bytes");
+
+	__builtin_memcpy(&k, (const char *)elem + offset, width);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	k >>= (sizeof(k) - width) * CHAR_BIT;
+#endif
+
+	switch (type) {
+	case QSORT_KEY_UNSIGNED:
+		return k;
+	case QSORT_KEY_SIGNED:
+		return k ^ sign;
+	case QSORT_KEY_FLOAT:
+		return (k & sign) ? ~k & mask : k | sign;
+	default:
+		BUILD_BUG();
+		return k;
+	}
 }
 
-/* Discontinue quicksort algorithm when partition gets below this size.
-   This particular magic number was chosen to work best on a Sun 4/260. */
-#define MAX_THRESH 4
+/* def's key of elem as _quicksort_bits gives it */
+static __always_inline uint64_t
+_quicksort_key_bits(const struct qsort_def *def, const void *elem) {
+	return _quicksort_bits(elem, def->key_offset, def->key_width,
+			       def->key_type);
+}
 
-/* Stack node declarations used to store unfulfilled partition obligations. */
-typedef struct
-  {
-    char *lo;
-    char *hi;
-  } stack_node;
+/* a key column's bits as _quicksort_bits gives them, inverted if the column
+ * is descending */
+static __always_inline uint64_t
+_quicksort_col_bits(const struct qsort_key_col *col, const void *elem) {
+	const uint64_t mask = ((uint64_t)2 << (col->width * CHAR_BIT - 1)) - 1;
+	const uint64_t k = _quicksort_bits(elem, col->offset, col->width,
+					   col->type);
 
-/* The next 4 #defines implement a very fast in-line stack abstraction. */
-/* The stack needs log (total_elements) entries (we could even subtract
-   log(MAX_THRESH)).  Since total_elements has type size_t, we get as
-   upper bound for log (total_elements):
-   bits per byte (CHAR_BIT) * sizeof(size_t).
-   However, this results in 1k of stack being allocated on 64 bit machines,
-   which is more than currently reasonable. Thus, for such machines, we'll cap
-   the max entries to 48 bits, or 281 trillion.
-   TODO: Add some mechanism to override this cap?
-   */
-#if (CHAR_BIT * __SIZEOF_SIZE_T__) < 48
-# define STACK_SIZE     (CHAR_BIT * sizeof(size_t))
-#else
-# define STACK_SIZE     48
-#endif
+	assert_const(col->desc);
+	return col->desc ? ~k & mask : k;
+}
 
-#define PUSH(low, high)	((void) ((top->lo = (low)), (top->hi = (high)), ++top))
-#define	POP(low, high)	((void) (--top, (low = top->lo), (high = top->hi)))
-#define	STACK_NOT_EMPTY	(stack < top)
+/**
+ * qsort_key_len - bytes in the qsort_key_normalize encoding of a key
+ * @def: the template parameters, with keys and nkeys
+ */
+static __always_inline size_t qsort_key_len(const struct qsort_def *def) {
+	size_t len = 0;
+	size_t i;
+
+	assert_const(def->nkeys);
+#pragma GCC unroll 16
+	for (i = 0; i < def->nkeys; ++i)
+		len += def->keys[i].width;
+	return len;
+}
 
+/*
+ * _quicksort_key_word -- bytes 8 * word through 8 * word + 7 of an element's
+ *                        qsort_key_normalize encoding, as a big-endian
+ *                        integer (zero padded past the end)
+ *
+ * Which columns land in the word is worked out at compile time, so this is
+ * just the loads, shifts and ors for those.
+ */
+static __always_inline uint64_t
+_quicksort_key_word(const struct qsort_def *def, const void *elem,
+		    size_t word) {
+	const size_t lo = word * 64;
+	size_t start = 0;
+	uint64_t w = 0;
+	size_t i;
+
+#pragma GCC unroll 16
+	for (i = 0; i < def->nkeys; ++i) {
+		const struct qsort_key_col *col = &def->keys[i];
+		const size_t end = start + col->width * CHAR_BIT;
+
+		/* bits start through end - 1 of the encoding are this column */
+		if (end > lo && start < lo + 64) {
+			const uint64_t k = _quicksort_col_bits(col, elem);
+
+			if (end <= lo + 64)
+				w |= k << (lo + 64 - end);
+			else
+				w |= k >> (end - lo - 64);
+		}
+		start = end;
+	}
+	return w;
+}
 
-/* Order size using quicksort.  This implementation incorporates
-   four optimizations discussed in Sedgewick:
+/**
+ * qsort_key_normalize - encode an element's key columns so that memcmp
+ *                       orders encodings as qsort_def::keys orders elements
+ * @def:  the template parameters, with keys and nkeys
+ * @elem: the element
+ * @out:  where to write the qsort_key_len(def) byte encoding
+ *
+ * Each column is written most significant byte first, signed and float
+ * columns transformed as for radix sorting and descending ones inverted.
+ */
+static __always_inline void
+qsort_key_normalize(const struct qsort_def *def, const void *elem, void *out) {
+	const size_t len = qsort_key_len(def);
+	unsigned char *o = out;
+	size_t i;
 
-   1. Non-recursive, using an explicit stack of pointer that store the
-      next array partition to sort.  To save time, this maximum amount
-      of space required to store an array of SIZE_MAX is allocated on the
-      stack.  Assuming a 32-bit (64 bit) integer for size_t, this needs
-      only 32 * sizeof(stack_node) == 256 bytes (for 64 bit: 768 bytes,
-      or 1024 bytes if uncapped). Pretty cheap, actually.
+#pragma GCC unroll 16
+	for (i = 0; i < len; i += 8) {
+		uint64_t w = _quicksort_key_word(def, elem, i / 8);
 
-   2. Chose the pivot element using a median-of-three decision tree.
-      This reduces the probability of selecting a bad pivot value and
-      eliminates certain extraneous comparisons.
+#if __BYTE_ORDER__ != __ORDER_BIG_ENDIAN__
+		w = __builtin_bswap64(w);
+#endif
+		__builtin_memcpy(o + i, &w, min(len - i, sizeof(w)));
+	}
+}
 
-   3. Only quicksorts TOTAL_ELEMS / MAX_THRESH partitions, leaving
-      insertion sort to order the MAX_THRESH items within each partition.
-      This is a big win, since insertion sort is faster for small, mostly
-      sorted array segments.
+/*
+ * _quicksort_keys_less -- the comparator synthesized from qsort_def::keys
+ *
+ * Compares column by column (or with key_normalize, 8 byte word by word)
+ * from the least significant up, carrying the result in a flag rather than
+ * returning at the first difference, so that it compiles to a chain of
+ * compares and selects rather than a branch per column.
+ */
+static __always_inline int
+_quicksort_keys_less(const struct qsort_def *def, const void *a,
+		     const void *b) {
+	int lt = 0;
+	size_t i;
+
+	assert_const(def->nkeys);
+	assert_const(def->key_normalize);
+	BUILD_BUG_ON_MSG(!def->nkeys, "keys requires nkeys");
+
+	if (def->key_normalize) {
+#pragma GCC unroll 16
+		for (i = (qsort_key_len(def) + 7) / 8; i--;) {
+			const uint64_t ka = _quicksort_key_word(def, a, i);
+			const uint64_t kb = _quicksort_key_word(def, b, i);
+
+			lt = (ka < kb) | ((ka == kb) & lt);
+		}
+	} else {
+#pragma GCC unroll 16
+		for (i = def->nkeys; i--;) {
+			const uint64_t ka = _quicksort_col_bits(&def->keys[i], a);
+			const uint64_t kb = _quicksort_col_bits(&def->keys[i], b);
+
+			lt = (ka < kb) | ((ka == kb) & lt);
+		}
+	}
+	return lt;
+}
 
-   4. The larger of the two sub-partitions is always pushed onto the
-      stack first, with the algorithm then concentrating on the
-      smaller partition.  This *guarantees* no more than log (n)
-      stack size is needed (actually O(1) in this case)!  */
+/**
+ * QSORT_KEYS_LESS - define a less function ordering elements by the key
+ *                   columns of a qsort_def
+ * @name: name of the function to define
+ * @def:  the static const struct qsort_def whose keys it compares by; it may
+ *        be declared before the macro and defined after, with .less = name
+ *
+ * The body is synthesized from def's keys at compile time and inlines like
+ * any other less. It's generated here, rather than qsort_template checking
+ * for keys at every comparison, so that sorts without keys don't pay for
+ * inlining it (and folding it away again) at each of them.
+ */
+#define QSORT_KEYS_LESS(name, def)					\
+	static __always_inline int name(const void *a, const void *b,	\
+					void *context) {		\
+		return _quicksort_keys_less(&(def), a, b);		\
+	}
 
-static __always_inline __flatten int
-qsort_template (const struct qsort_def *def, void *const pbase,
-                size_t n, void *arg)
-{
-  /* this copy of def will be mutated to manage indirect sorting if needed */
-  struct qsort_def d = *def;
-  char *base_ptr = (char *) pbase;
-  size_t max_thresh;
+/* Compare-exchange for the sorting networks below. Written as a pair of
+ * selects so that gcc emits conditional moves (or SIMD min/max when it can
+ * vectorize) instead of branches. */
+#define _QSORT_CE(v, i, j)						\
+	do {								\
+		__typeof__((v)[0]) _a = (v)[i], _b = (v)[j];		\
+		(v)[i] = _b < _a ? _b : _a;				\
+		(v)[j] = _b < _a ? _a : _b;				\
+	} while (0)
 
-  /* The real size allocated is MAX_TMP_STACK_SIZE + d.align - 1. This space is
-   * in addition to the 256 to 768 (or 1024 if uncapped) bytes used in the
-   * primary loop. */
-  const size_t MAX_TMP_STACK_SIZE = 512;
-  int elem_buf_on_heap = 0;        /* ct const */
-  int index_on_heap    = 0;        /* ct const */
-  /* Use indirect sorting if size is large */
-  int indirect         = d.size > _QSORT_IND_THRESH; /* ct const */
-  size_t tmp_needed    = 0;        /* both (can result in either ct or rt value) */
-  int ret              = 0;
+/* optimal 4-input network, 5 comparators */
+#define _QSORT_NETWORK4(v, ce)						\
+	do {								\
+		ce(v, 0, 1); ce(v, 2, 3);				\
+		ce(v, 0, 2); ce(v, 1, 3);				\
+		ce(v, 1, 2);						\
+	} while (0)
 
-  if (n == 0)
-    /* Avoid lossage with unsigned arithmetic below.  */
-    return 0;
+/* optimal 8-input network, 19 comparators */
+#define _QSORT_NETWORK8(v, ce)						\
+	do {								\
+		ce(v, 0, 2); ce(v, 1, 3);				\
+		ce(v, 4, 6); ce(v, 5, 7);				\
+		ce(v, 0, 4); ce(v, 1, 5);				\
+		ce(v, 2, 6); ce(v, 3, 7);				\
+		ce(v, 0, 1); ce(v, 2, 3);				\
+		ce(v, 4, 5); ce(v, 6, 7);				\
+		ce(v, 2, 4); ce(v, 3, 5);				\
+		ce(v, 1, 4); ce(v, 3, 6);				\
+		ce(v, 1, 2); ce(v, 3, 4); ce(v, 5, 6);			\
+	} while (0)
 
-  /* Restrict to reasonable value */
-  if (d.align > _QSORT_ALIGN_MAX)
-    d.align = _QSORT_ALIGN_MAX;
+/* Green's 16-input network, 60 comparators in 10 layers */
+#define _QSORT_NETWORK16(v, ce)						\
+	do {								\
+		ce(v, 0, 13); ce(v, 1, 12); ce(v, 2, 15);		\
+		ce(v, 3, 14); ce(v, 4, 8);  ce(v, 5, 6);		\
+		ce(v, 7, 11); ce(v, 9, 10);				\
+		ce(v, 0, 5);  ce(v, 1, 7);  ce(v, 2, 9);		\
+		ce(v, 3, 4);  ce(v, 6, 13); ce(v, 8, 14);		\
+		ce(v, 10, 15); ce(v, 11, 12);				\
+		ce(v, 0, 1);  ce(v, 2, 3);  ce(v, 4, 5);		\
+		ce(v, 6, 8);  ce(v, 7, 9);  ce(v, 10, 11);		\
+		ce(v, 12, 13); ce(v, 14, 15);				\
+		ce(v, 0, 2);  ce(v, 1, 3);  ce(v, 4, 10);		\
+		ce(v, 5, 11); ce(v, 6, 7);  ce(v, 8, 9);		\
+		ce(v, 12, 14); ce(v, 13, 15);				\
+		ce(v, 1, 2);  ce(v, 3, 12); ce(v, 4, 6);		\
+		ce(v, 5, 7);  ce(v, 8, 10); ce(v, 9, 11);		\
+		ce(v, 13, 14);						\
+		ce(v, 1, 4);  ce(v, 2, 6);  ce(v, 5, 8);		\
+		ce(v, 7, 10); ce(v, 9, 13); ce(v, 11, 14);		\
+		ce(v, 2, 4);  ce(v, 3, 6);  ce(v, 9, 12);		\
+		ce(v, 11, 13);						\
+		ce(v, 3, 5);  ce(v, 6, 8);  ce(v, 7, 9);		\
+		ce(v, 10, 12);						\
+		ce(v, 3, 4);  ce(v, 5, 6);  ce(v, 7, 8);		\
+		ce(v, 9, 10); ce(v, 11, 12);				\
+		ce(v, 6, 7);  ce(v, 8, 9);				\
+	} while (0)
 
-  if (!d.max_size_bits)
-    d.max_size_bits = sizeof(size_t) * 8 * 4 / 3;
+/* Defines a function that sorts up to _QSORT_NETWORK_MAX keys of type in
+ * place. The keys are loaded into a local array, padded out to the network's
+ * width with pad (which must sort last) and stored back. */
+#define _QSORT_NETWORK_FN(name, type, pad)				\
+static __always_inline void						\
+name(char *base, size_t n) {						\
+	type v[_QSORT_NETWORK_MAX];					\
+	const size_t width = n <= 4 ? 4 : n <= 8 ? 8 : 16;		\
+	size_t i;							\
+									\
+	for (i = 0; i < n; ++i)						\
+		__builtin_memcpy(&v[i], base + i * sizeof(type), sizeof(type)); \
+	for (; i < width; ++i)						\
+		v[i] = (pad);						\
+									\
+	if (width == 4)							\
+		_QSORT_NETWORK4(v, _QSORT_CE);				\
+	else if (width == 8)						\
+		_QSORT_NETWORK8(v, _QSORT_CE);				\
+	else								\
+		_QSORT_NETWORK16(v, _QSORT_CE);				\
+									\
+	for (i = 0; i < n; ++i)						\
+		__builtin_memcpy(base + i * sizeof(type), &v[i], sizeof(type)); \
+}
 
-  if (!d.max_thresh)
-    d.max_thresh = 4;
+_QSORT_NETWORK_FN(_quicksort_network_u8,  uint8_t,  UINT8_MAX)
+_QSORT_NETWORK_FN(_quicksort_network_s8,  int8_t,   INT8_MAX)
+_QSORT_NETWORK_FN(_quicksort_network_u16, uint16_t, UINT16_MAX)
+_QSORT_NETWORK_FN(_quicksort_network_s16, int16_t,  INT16_MAX)
+_QSORT_NETWORK_FN(_quicksort_network_u32, uint32_t, UINT32_MAX)
+_QSORT_NETWORK_FN(_quicksort_network_s32, int32_t,  INT32_MAX)
+_QSORT_NETWORK_FN(_quicksort_network_u64, uint64_t, UINT64_MAX)
+_QSORT_NETWORK_FN(_quicksort_network_s64, int64_t,  INT64_MAX)
+_QSORT_NETWORK_FN(_quicksort_network_f32, float,    __builtin_inff())
+_QSORT_NETWORK_FN(_quicksort_network_f64, double,   __builtin_inf())
+
+#undef _QSORT_NETWORK_FN
+
+/* compare-exchange on vectors of integers: lane-wise min to i, max to j */
+#define _QSORT_VCE(v, i, j)						\
+	do {								\
+		__typeof__((v)[0]) _a = (v)[i], _b = (v)[j];		\
+		__typeof__((v)[0]) _m = (__typeof__(_a))(_b < _a);	\
+		(v)[i] = (_b & _m) | (_a & ~_m);			\
+		(v)[j] = (_a & _m) | (_b & ~_m);			\
+	} while (0)
 
-  if (!d.max_stack_space)
-    d.max_stack_space = 1024;
+/* Defines a function that sorts _QSORT_BATCH_LANES consecutive groups of n
+ * (at most _QSORT_NETWORK_MAX) integer keys of type at once: the groups are
+ * transposed so that element i of every group is in v[i], one group per
+ * lane, and the sorting network is run on the vectors. */
+#define _QSORT_BATCH_NETWORK_FN(name, type, pad)			\
+static __always_inline void						\
+name(char *base, size_t n) {						\
+	typedef type vec __attribute__((vector_size(sizeof(type) * _QSORT_BATCH_LANES))); \
+	vec v[_QSORT_NETWORK_MAX];					\
+	const size_t width = n <= 4 ? 4 : n <= 8 ? 8 : 16;		\
+	size_t i, g;							\
+									\
+	for (i = 0; i < n; ++i)						\
+		for (g = 0; g < _QSORT_BATCH_LANES; ++g) {		\
+			type k;						\
+			__builtin_memcpy(&k, base + (g * n + i) * sizeof(type), sizeof(type)); \
+			v[i][g] = k;					\
+		}							\
+	for (; i < width; ++i)						\
+		v[i] = (vec){0} + (type)(pad);				\
+									\
+	if (width == 4)							\
+		_QSORT_NETWORK4(v, _QSORT_VCE);				\
+	else if (width == 8)						\
+		_QSORT_NETWORK8(v, _QSORT_VCE);				\
+	else								\
+		_QSORT_NETWORK16(v, _QSORT_VCE);			\
+									\
+	for (i = 0; i < n; ++i)						\
+		for (g = 0; g < _QSORT_BATCH_LANES; ++g) {		\
+			type k = v[i][g];				\
+			__builtin_memcpy(base + (g * n + i) * sizeof(type), &k, sizeof(type)); \
+		}							\
+}
 
+_QSORT_BATCH_NETWORK_FN(_quicksort_batch_network_u8,  uint8_t,  UINT8_MAX)
+_QSORT_BATCH_NETWORK_FN(_quicksort_batch_network_s8,  int8_t,   INT8_MAX)
+_QSORT_BATCH_NETWORK_FN(_quicksort_batch_network_u16, uint16_t, UINT16_MAX)
+_QSORT_BATCH_NETWORK_FN(_quicksort_batch_network_s16, int16_t,  INT16_MAX)
+_QSORT_BATCH_NETWORK_FN(_quicksort_batch_network_u32, uint32_t, UINT32_MAX)
+_QSORT_BATCH_NETWORK_FN(_quicksort_batch_network_s32, int32_t,  INT32_MAX)
+_QSORT_BATCH_NETWORK_FN(_quicksort_batch_network_u64, uint64_t, UINT64_MAX)
+_QSORT_BATCH_NETWORK_FN(_quicksort_batch_network_s64, int64_t,  INT64_MAX)
+
+#undef _QSORT_BATCH_NETWORK_FN
+
+/* non-zero if def asks for, and can use, the sorting networks */
+static __always_inline int
+_quicksort_network_ok(const struct qsort_def *def) {
+	return def->network
+	    && !def->key_offset
+	    && def->key_width == def->size
+	    && (def->size == 1 || def->size == 2 || def->size == 4 || def->size == 8)
+	    && (def->key_type != QSORT_KEY_FLOAT || def->size >= 4);
+}
 
-  assert_const(!!d.less);
-  assert_const(d.align + d.size);
-  BUILD_BUG_ON_MSG(!d.less, "less function is required");
+/*
+ * _quicksort_network -- sort n (at most _QSORT_NETWORK_MAX) elements with a
+ *                       sorting network
+ */
+static __always_inline void
+_quicksort_network(const struct qsort_def *def, char *base, size_t n) {
+	const int is_signed = def->key_type == QSORT_KEY_SIGNED;
 
-#if __STDC_VERSION__ >= 201112L
-  BUILD_BUG_ON_MSG(_Alignof(max_align_t) & (_Alignof(max_align_t) - 1),
-                   "_Alignof(max_align_t) is not a power of two");
-#endif
+	assert(n <= _QSORT_NETWORK_MAX);
 
-  BUILD_BUG_ON_MSG(d.align & (d.align - 1), "align must be a power of two");
-  BUILD_BUG_ON_MSG(d.size % d.align, "size must be a multiple of align");
+	if (def->key_type == QSORT_KEY_FLOAT) {
+		if (def->size == 4)
+			_quicksort_network_f32(base, n);
+		else
+			_quicksort_network_f64(base, n);
+		return;
+	}
 
-  /* verify pbase is really aligned as advertised */
-  assert_early(!((uintptr_t)pbase & (d.align - 1)));
+	switch (def->size) {
+	case 1: is_signed ? _quicksort_network_s8(base, n)  : _quicksort_network_u8(base, n);  break;
+	case 2: is_signed ? _quicksort_network_s16(base, n) : _quicksort_network_u16(base, n); break;
+	case 4: is_signed ? _quicksort_network_s32(base, n) : _quicksort_network_u32(base, n); break;
+	case 8: is_signed ? _quicksort_network_s64(base, n) : _quicksort_network_u64(base, n); break;
+	default: BUILD_BUG();
+	}
+}
 
-  if (!d.elem_buf)
-    tmp_needed += def->size;
+/*
+ * _quicksort_batch_network -- sort _QSORT_BATCH_LANES consecutive groups of n
+ *                             (at most _QSORT_NETWORK_MAX) integer keys each
+ */
+static __always_inline void
+_quicksort_batch_network(const struct qsort_def *def, char *base, size_t n) {
+	const int is_signed = def->key_type == QSORT_KEY_SIGNED;
+
+	assert(n <= _QSORT_NETWORK_MAX);
+	BUILD_BUG_ON_MSG(def->key_type == QSORT_KEY_FLOAT,
+			 "float keys can't be sorted across lanes");
+
+	switch (def->size) {
+	case 1: is_signed ? _quicksort_batch_network_s8(base, n)  : _quicksort_batch_network_u8(base, n);  break;
+	case 2: is_signed ? _quicksort_batch_network_s16(base, n) : _quicksort_batch_network_u16(base, n); break;
+	case 4: is_signed ? _quicksort_batch_network_s32(base, n) : _quicksort_batch_network_u32(base, n); break;
+	case 8: is_signed ? _quicksort_batch_network_s64(base, n) : _quicksort_batch_network_u64(base, n); break;
+	default: BUILD_BUG();
+	}
+}
 
-  if (d.size > _QSORT_IND_THRESH || !d.index)
-    tmp_needed += sizeof(void *) * n;
+/* An index entry when sorting with qsort_def::prefix_cache. */
+struct _quicksort_prefixed {
+	uint64_t prefix;
+	void *elem;
+};
 
-  /* if we don't already have a temp element buffer allocate one now */
-  if (!d.elem_buf)
+/*
+ * _quicksort_less -- compare two elements, following them to the real data
+ *                    according to indirect (one of _QSORT_DIRECT,
+ *                    _QSORT_INDIRECT_PTR, _QSORT_INDIRECT_OFF32 or
+ *                    _QSORT_INDIRECT_PREFIX)
+ */
+static __always_inline __flatten int
+_quicksort_less(const struct qsort_def *def, int indirect, void *a, void *b, void *arg) {
+  _QSORT_STAT_ADD (def, compares, 1);
+
+  if (indirect == _QSORT_INDIRECT_PREFIX)
     {
-      /* try to get an aligned d.elem_buf buffer the as large as size */
-      if (d.size > MAX_TMP_STACK_SIZE)
-        {
-          /* FIXME: pre C11 compat */
-          d.elem_buf = aligned_alloc(d.align, d.size);
-          elem_buf_on_heap = 1;
+      const struct _quicksort_prefixed *pa = a;
+      const struct _quicksort_prefixed *pb = b;
 
-          if (!d.elem_buf)
-            return ENOMEM;
-        }
-      else
-        {
-          size_t offset;
-          /* put it on the stack */
-          d.elem_buf = alloca (d.size + d.align - 1);
+      if (pa->prefix != pb->prefix)
+        return pa->prefix < pb->prefix;
+      return def->less(pa->elem, pb->elem, arg);
+    }
 
-          /* align it */
-          offset = (uintptr_t)d.elem_buf % d.align;
+  if (indirect == _QSORT_INDIRECT_OFF32)
+    return def->less(def->ind_base + *(uint32_t *)a * def->ind_size,
+                     def->ind_base + *(uint32_t *)b * def->ind_size, arg);
+
+  return indirect
+       ? def->less(*((void**)a), *((void**)b), arg)
+       : def->less(a, b, arg);
+}
+
+/*
+ * _quicksort_siftdown -- restore the max-heap property below root
+ * def:         the template parameters
+ * indirect:    non-zero if elements are pointers to the real data
+ * base:        first element of the heap
+ * root:        index of the element to sift down
+ * n:           number of elements in the heap
+ */
+static __always_inline void
+_quicksort_siftdown(const struct qsort_def *def, int indirect, char *base,
+		    size_t root, size_t n, void *arg) {
+	const size_t size = def->size;
+	size_t child;
+
+	while ((child = 2 * root + 1) < n) {
+		char *c = base + child * size;
+
+		if (child + 1 < n && _quicksort_less(def, indirect, c, c + size, arg)) {
+			++child;
+			c += size;
+		}
+
+		if (!_quicksort_less(def, indirect, base + root * size, c, arg))
+			return;
+
+		_quicksort_swap(def, base + root * size, c);
+		root = child;
+	}
+}
+
+/*
+ * _quicksort_heapsort -- in-place heapsort of the elements lo through hi
+ *                        (inclusive), used as the introsort fallback
+ */
+static __always_inline void
+_quicksort_heapsort(const struct qsort_def *def, int indirect, char *lo,
+		    char *hi, void *arg) {
+	const size_t size = def->size;
+	const size_t n = (size_t)(hi - lo) / size + 1;
+	size_t i;
+
+	for (i = n / 2; i--;)
+		_quicksort_siftdown(def, indirect, lo, i, n, arg);
+
+	for (i = n; --i;) {
+		_quicksort_swap(def, lo, lo + i * size);
+		_quicksort_siftdown(def, indirect, lo, 0, i, arg);
+	}
+}
+
+/* sort the three elements a, b and c */
+static __always_inline void
+_quicksort_sort3(const struct qsort_def *def, int indirect, char *a, char *b,
+		 char *c, void *arg) {
+	if (_quicksort_less(def, indirect, b, a, arg))
+		_quicksort_swap(def, a, b);
+	if (_quicksort_less(def, indirect, c, b, arg)) {
+		_quicksort_swap(def, b, c);
+		if (_quicksort_less(def, indirect, b, a, arg))
+			_quicksort_swap(def, a, b);
+	}
+}
+
+/*
+ * _quicksort_pivot_sampled -- move the ninther, or for QSORT_PIVOT_ADAPTIVE
+ *                             and huge partitions the median of a sqrt(n)
+ *                             sample, to mid
+ * lo:          first element of the partition
+ * mid:         its middle element
+ * hi:          last element of the partition
+ *
+ * Like median-of-three, leaves a sample no greater than the pivot at lo and
+ * one no less than it at hi, so both still work as sentinels.
+ */
+static __always_inline void
+_quicksort_pivot_sampled(const struct qsort_def *def, int indirect, char *lo,
+			 char *mid, char *hi, void *arg) {
+	const size_t size = def->size;
+	const size_t n = (size_t)(hi - lo) / size + 1;
+
+	if (def->pivot == QSORT_PIVOT_ADAPTIVE && n >= _QSORT_SAMPLE_THRESH) {
+		/* an odd number of samples, about sqrt(n), gathered around mid
+		 * and sorted there, leaving their median on it */
+		const unsigned bits = sizeof(long) * CHAR_BIT - __builtin_clzl(n);
+		const size_t k = ((size_t)1 << bits / 2) | 1;
+		const size_t step = n / k;
+		char *first = mid - k / 2 * size;
+		char *last = first + (k - 1) * size;
+		size_t i;
+
+		for (i = 0; i < k; ++i)
+			if (first + i * size != lo + i * step * size)
+				_quicksort_swap(def, first + i * size,
+						lo + i * step * size);
+
+		_quicksort_heapsort(def, indirect, first, last, arg);
+		_quicksort_swap(def, lo, first);
+		_quicksort_swap(def, hi, last);
+	} else {
+		const size_t s = n / 8 * size;
+
+		_quicksort_sort3(def, indirect, lo, lo + s, lo + 2 * s, arg);
+		_quicksort_sort3(def, indirect, mid - s, mid, mid + s, arg);
+		_quicksort_sort3(def, indirect, hi - 2 * s, hi - s, hi, arg);
+		_quicksort_sort3(def, indirect, lo + s, mid, hi - s, arg);
+
+		/* the smallest and largest of the medians become the sentinels */
+		_quicksort_swap(def, lo, lo + s);
+		_quicksort_swap(def, hi, hi - s);
+	}
+}
+
+/*
+ * _quicksort_swap_offsets -- swap num pairs of elements, the left one of each
+ *                            pair at first + offsets_l[i] and the right one at
+ *                            last - offsets_r[i]
+ */
+static __always_inline void
+_quicksort_swap_offsets(const struct qsort_def *def, char *first, char *last,
+			const unsigned char *offsets_l,
+			const unsigned char *offsets_r, size_t num) {
+	const size_t size = def->size;
+	size_t i;
+
+	for (i = 0; i < num; ++i)
+		_quicksort_swap(def, first + offsets_l[i] * size,
+				last - offsets_r[i] * size);
+}
+
+/*
+ * _quicksort_partition_block -- partition lo through hi (inclusive) around
+ *                               the pivot at lo without branching on the
+ *                               result of less
+ * def:         the template parameters
+ * indirect:    non-zero if elements are pointers to the real data
+ * lo:          first element, which must be the pivot
+ * hi:          last element
+ * already_partitioned: set to non-zero if no elements needed to be moved
+ *
+ * This is the BlockQuicksort scheme (Edelkamp & Weiss) as used by Orson
+ * Peters' pdqsort: the outcome of each comparison is buffered into blocks of
+ * offsets, which are then swapped in bulk. Elements less than the pivot end
+ * up to its left and all others to its right.
+ *
+ * Returns the final position of the pivot.
+ */
+static __always_inline char *
+_quicksort_partition_block(const struct qsort_def *def, int indirect,
+			   char *lo, char *hi, int *already_partitioned,
+			   void *arg) {
+	const size_t size = def->size;
+	const size_t B = _QSORT_BLOCK_SIZE;
+	unsigned char offsets_l[_QSORT_BLOCK_SIZE];
+	unsigned char offsets_r[_QSORT_BLOCK_SIZE];
+	size_t num_l = 0, num_r = 0, start_l = 0, start_r = 0;
+	size_t l_size, r_size, unknown_left, num, i;
+	char *first = lo + size;
+	char *last  = hi + size;	/* one past the end */
+	char *pivot_pos;
+
+	BUILD_BUG_ON(_QSORT_BLOCK_SIZE > UCHAR_MAX);
+
+	/* skip over elements that are already on the correct side */
+	while (first < last && _quicksort_less(def, indirect, first, lo, arg))
+		first += size;
+	while (first < last && !_quicksort_less(def, indirect, last - size, lo, arg))
+		last -= size;
+
+	*already_partitioned = first >= last;
+	if (!*already_partitioned) {
+		_quicksort_swap(def, first, last - size);
+		first += size;
+		last  -= size;
+	}
+
+	while ((size_t)(last - first) > 2 * B * size) {
+		if (!num_l) {
+			start_l = 0;
+			for (i = 0; i < B; ++i) {
+				offsets_l[num_l] = i;
+				num_l += !_quicksort_less(def, indirect, first + i * size, lo, arg);
+			}
+		}
+
+		if (!num_r) {
+			start_r = 0;
+			for (i = 0; i < B; ++i) {
+				offsets_r[num_r] = i + 1;
+				num_r += !!_quicksort_less(def, indirect, last - (i + 1) * size, lo, arg);
+			}
+		}
+
+		num = min(num_l, num_r);
+		_quicksort_swap_offsets(def, first, last, offsets_l + start_l,
+					offsets_r + start_r, num);
+		num_l   -= num;
+		num_r   -= num;
+		start_l += num;
+		start_r += num;
+
+		if (!num_l)
+			first += B * size;
+		if (!num_r)
+			last  -= B * size;
+	}
+
+	/* partition whatever is left over, at most two blocks worth */
+	unknown_left = (size_t)(last - first) / size - ((num_r || num_l) ? B : 0);
+	if (num_r) {
+		l_size = unknown_left;
+		r_size = B;
+	} else if (num_l) {
+		l_size = B;
+		r_size = unknown_left;
+	} else {
+		l_size = unknown_left / 2;
+		r_size = unknown_left - l_size;
+	}
+
+	if (unknown_left && !num_l) {
+		start_l = 0;
+		for (i = 0; i < l_size; ++i) {
+			offsets_l[num_l] = i;
+			num_l += !_quicksort_less(def, indirect, first + i * size, lo, arg);
+		}
+	}
+
+	if (unknown_left && !num_r) {
+		start_r = 0;
+		for (i = 0; i < r_size; ++i) {
+			offsets_r[num_r] = i + 1;
+			num_r += !!_quicksort_less(def, indirect, last - (i + 1) * size, lo, arg);
+		}
+	}
+
+	num = min(num_l, num_r);
+	_quicksort_swap_offsets(def, first, last, offsets_l + start_l,
+				offsets_r + start_r, num);
+	num_l   -= num;
+	num_r   -= num;
+	start_l += num;
+	start_r += num;
+
+	if (!num_l)
+		first += l_size * size;
+	if (!num_r)
+		last  -= r_size * size;
+
+	/* at most one side still has misplaced elements; move them next to the
+	 * boundary */
+	if (num_l) {
+		while (num_l--) {
+			last -= size;
+			_quicksort_swap(def, first + offsets_l[start_l + num_l] * size, last);
+		}
+		first = last;
+	}
+
+	if (num_r) {
+		while (num_r--) {
+			_quicksort_swap(def, last - offsets_r[start_r + num_r] * size, first);
+			first += size;
+		}
+		last = first;
+	}
+
+	/* put the pivot in its final place */
+	pivot_pos = first - size;
+	if (pivot_pos != lo)
+		_quicksort_swap(def, lo, pivot_pos);
+
+	return pivot_pos;
+}
+
+/*
+ * _quicksort_vecswap -- swap the n elements starting at a with the n elements
+ *                       starting at b
+ */
+static __always_inline void
+_quicksort_vecswap(const struct qsort_def *def, char *a, char *b, size_t n) {
+	const size_t size = def->size;
+
+	for (; n; --n, a += size, b += size)
+		_quicksort_swap(def, a, b);
+}
+
+/*
+ * _quicksort_partition_three_way -- partition lo through hi (inclusive) into
+ *                                   elements less than, equal to and greater
+ *                                   than the pivot at lo
+ * def:         the template parameters
+ * indirect:    non-zero if elements are pointers to the real data
+ * lo:          first element, which must be the pivot
+ * hi:          last element
+ * lt_end:      set to the last element less than the pivot
+ * gt_start:    set to the first element greater than the pivot
+ *
+ * This is the split-end scheme from Bentley & McIlroy's "Engineering a Sort
+ * Function": equal keys are swapped out to both ends as they are found and
+ * then swapped back into the middle once the scan is done. Either of the
+ * outer ranges may be empty, in which case lt_end is lo - size or gt_start
+ * is hi + size.
+ */
+static __always_inline void
+_quicksort_partition_three_way(const struct qsort_def *def, int indirect,
+			       char *lo, char *hi, char **lt_end,
+			       char **gt_start, void *arg) {
+	const size_t size = def->size;
+	char *a = lo + size, *b = lo + size;
+	char *c = hi, *d = hi;
+	size_t l, r;
+
+	for (;;) {
+		while (b <= c && !_quicksort_less(def, indirect, lo, b, arg)) {
+			if (!_quicksort_less(def, indirect, b, lo, arg)) {
+				_quicksort_swap(def, a, b);
+				a += size;
+			}
+			b += size;
+		}
+
+		while (b <= c && !_quicksort_less(def, indirect, c, lo, arg)) {
+			if (!_quicksort_less(def, indirect, lo, c, arg)) {
+				_quicksort_swap(def, c, d);
+				d -= size;
+			}
+			c -= size;
+		}
+
+		if (b > c)
+			break;
+
+		_quicksort_swap(def, b, c);
+		b += size;
+		c -= size;
+	}
+
+	/* lo..a-1 and d+1..hi now hold the equal keys; bring them inwards */
+	l = min((size_t)(a - lo), (size_t)(b - a)) / size;
+	_quicksort_vecswap(def, lo, b - l * size, l);
+	r = min((size_t)(d - c), (size_t)(hi - d)) / size;
+	_quicksort_vecswap(def, b, hi + size - r * size, r);
+
+	*lt_end   = lo + (b - a) - size;
+	*gt_start = hi + size - (d - c);
+}
+
+/*
+ * _quicksort_upper_bound -- find where to insert elem into the sorted range
+ *                           [lo, hi), after any equal elements
+ */
+static __always_inline char *
+_quicksort_upper_bound(const struct qsort_def *def, int indirect, char *lo,
+		       char *hi, void *elem, void *arg) {
+	size_t n = (size_t)(hi - lo) / def->size;
+
+	while (n) {
+		const size_t half = n / 2;
+		char *mid = lo + half * def->size;
+
+		if (_quicksort_less(def, indirect, elem, mid, arg)) {
+			n = half;
+		} else {
+			lo = mid + def->size;
+			n -= half + 1;
+		}
+	}
+
+	return lo;
+}
+
+/*
+ * _quicksort_insertion_point -- find where to insert cur into the sorted
+ *                               range [lo, cur), after any equal elements
+ *
+ * Probes 1, 2, 4, ... elements back from cur until one isn't greater, then
+ * binary searches the last gap, so an element that moves d places costs
+ * about 2 * log2(d) comparisons.
+ */
+static __always_inline char *
+_quicksort_insertion_point(const struct qsort_def *def, int indirect,
+			   char *lo, char *cur, void *arg) {
+	const size_t size = def->size;
+	size_t step = 1;
+	char *hi = cur;		/* everything in [hi, cur) is greater */
+
+	for (;;) {
+		char *probe;
+
+		if (step > (size_t)(hi - lo) / size)
+			return _quicksort_upper_bound(def, indirect, lo, hi, cur, arg);
+
+		probe = hi - step * size;
+		if (!_quicksort_less(def, indirect, cur, probe, arg))
+			return _quicksort_upper_bound(def, indirect, probe + size,
+						      hi, cur, arg);
+		hi = probe;
+		step *= 2;
+	}
+}
+
+/*
+ * _quicksort_partial_insertion -- attempt to insertion sort lo through hi
+ *                                 (inclusive)
+ *
+ * Gives up once more than _QSORT_PARTIAL_INSERTION_LIMIT elements have been
+ * moved, leaving the range partially sorted.
+ *
+ * Returns non-zero if the range is now sorted.
+ */
+static __always_inline int
+_quicksort_partial_insertion(const struct qsort_def *def, int indirect,
+			     char *lo, char *hi, void *arg) {
+	const size_t size = def->size;
+	size_t moved = 0;
+	char *cur;
+
+	if (hi <= lo)
+		return 1;
+
+	for (cur = lo + size; cur <= hi; cur += size) {
+		char *sift = cur;
+
+		if (def->binary_insertion)
+			sift = _quicksort_insertion_point(def, indirect, lo, cur, arg);
+		else
+			while (sift != lo && _quicksort_less(def, indirect, cur, sift - size, arg))
+				sift -= size;
+
+		if (sift != cur) {
+			_quicksort_ror(def, sift, cur);
+			moved += (size_t)(cur - sift) / size;
+		}
+
+		if (moved > _QSORT_PARTIAL_INSERTION_LIMIT)
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * _quicksort_break_patterns -- swap a few elements on each side of a badly
+ *                              unbalanced partition so that the pattern that
+ *                              produced it is unlikely to persist
+ * lo:          first element of the partition
+ * pivot_pos:   final position of the pivot
+ * hi:          last element of the partition
+ */
+static __always_inline void
+_quicksort_break_patterns(const struct qsort_def *def, char *lo,
+			  char *pivot_pos, char *hi) {
+	const size_t size = def->size;
+	const size_t l_size = (size_t)(pivot_pos - lo) / size;
+	const size_t r_size = (size_t)(hi - pivot_pos) / size;
+
+	if (l_size >= 24) {
+		const size_t q = l_size / 4;
+
+		_quicksort_swap(def, lo, lo + q * size);
+		_quicksort_swap(def, pivot_pos - size, pivot_pos - q * size);
+
+		if (l_size > 128) {
+			_quicksort_swap(def, lo + 1 * size, lo + (q + 1) * size);
+			_quicksort_swap(def, lo + 2 * size, lo + (q + 2) * size);
+			_quicksort_swap(def, pivot_pos - 2 * size, pivot_pos - (q + 1) * size);
+			_quicksort_swap(def, pivot_pos - 3 * size, pivot_pos - (q + 2) * size);
+		}
+	}
+
+	if (r_size >= 24) {
+		const size_t q = r_size / 4;
+
+		_quicksort_swap(def, pivot_pos + size, pivot_pos + (q + 1) * size);
+		_quicksort_swap(def, hi, hi - q * size);
+
+		if (r_size > 128) {
+			_quicksort_swap(def, pivot_pos + 2 * size, pivot_pos + (q + 2) * size);
+			_quicksort_swap(def, pivot_pos + 3 * size, pivot_pos + (q + 3) * size);
+			_quicksort_swap(def, hi - 1 * size, hi - (q + 1) * size);
+			_quicksort_swap(def, hi - 2 * size, hi - (q + 2) * size);
+		}
+	}
+}
+
+/*
+ * _quicksort_permute -- re-arrange an array into the order of an index
+ * def:         the template parameters of the elements (not the index)
+ * pbase:       the array
+ * index:       n pointers into pbase, index[i] pointing to the element that
+ *              belongs at position i; on return, index[i] points to i
+ * n:           number of elements
+ * elem_buf:    temporary storage for one element
+ *
+ * Each cycle of the permutation is followed, so every element is copied once
+ * plus one extra copy per cycle.
+ */
+static __always_inline void
+_quicksort_permute(const struct qsort_def *def, void *pbase, void **index,
+		   size_t n, void *elem_buf) {
+	size_t i;	/* current element (indecies) */
+	char *ip;	/* pointer to the current element */
+	char *kp;
+
+	for (i = 0, ip = (char *)pbase; i < n; ++i, ip += def->size) {
+		if ((kp = index[i]) != ip) {
+			size_t j = i;
+			char *jp = ip;
+			_QSORT_STAT_ADD(def, perm_cycles, 1);
+			_quicksort_copy(def, elem_buf, ip);
+
+			do {
+				size_t k = (kp - (char *)pbase) / def->size;
+				index[j] = jp;
+				_quicksort_copy(def, jp, kp);
+				j = k;
+				jp = kp;
+				kp = index[k];
+			} while (kp != ip);
+
+			index[j] = jp;
+			_quicksort_copy(def, jp, elem_buf);
+		}
+	}
+}
+
+/*
+ * _quicksort_permute32 -- _quicksort_permute for an index of 32-bit element
+ *                         numbers; on return, index[i] is i
+ */
+static __always_inline void
+_quicksort_permute32(const struct qsort_def *def, void *pbase, uint32_t *index,
+		     size_t n, void *elem_buf) {
+	char *const base = pbase;
+	size_t i;
+
+	for (i = 0; i < n; ++i) {
+		if (index[i] != i) {
+			size_t j = i;
+			size_t k = index[i];
+
+			_QSORT_STAT_ADD(def, perm_cycles, 1);
+			_quicksort_copy(def, elem_buf, base + i * def->size);
+
+			do {
+				index[j] = j;
+				_quicksort_copy(def, base + j * def->size,
+						base + k * def->size);
+				j = k;
+				k = index[k];
+			} while (k != i);
+
+			index[j] = j;
+			_quicksort_copy(def, base + j * def->size, elem_buf);
+		}
+	}
+}
+
+/*
+ * _quicksort_gather -- copy the elements of a sorted index, in order, to dst
+ * def:         the template parameters of the real elements
+ * indirect:    the kind of index (_QSORT_INDIRECT_*)
+ * base:        the array the index refers to
+ *
+ * Writes dst sequentially while prefetching the (scattered) elements
+ * _QSORT_GATHER_PREFETCH entries ahead, every cache line of them.
+ */
+static __always_inline void
+_quicksort_gather(const struct qsort_def *def, int indirect, char *dst,
+		  const void *index, const char *base, size_t n) {
+	const size_t size = def->size;
+	const uint32_t *index32 = index;
+	const struct _quicksort_prefixed *entries = index;
+	const void *const *ptrs = index;
+	size_t i, off;
+
+#define _QSORT_GATHER_ELEM(i)						\
+	(indirect == _QSORT_INDIRECT_OFF32  ? base + index32[i] * size :	\
+	 indirect == _QSORT_INDIRECT_PREFIX ? (const char *)entries[i].elem :	\
+					      (const char *)ptrs[i])
+
+	for (i = 0; i < n; ++i, dst += size) {
+		if (i + _QSORT_GATHER_PREFETCH < n) {
+			const char *ahead = _QSORT_GATHER_ELEM(i + _QSORT_GATHER_PREFETCH);
+
+			for (off = 0; off < size; off += 64)
+				__builtin_prefetch(ahead + off, 0, 0);
+		}
+		_quicksort_copy(def, dst, _QSORT_GATHER_ELEM(i));
+	}
+
+#undef _QSORT_GATHER_ELEM
+}
+
+/* which of the _QSORT_DIRECT/_QSORT_INDIRECT_* modes qsort_template uses */
+static __always_inline int
+_quicksort_indirect_mode(const struct qsort_def *def) {
+	/* fewer than 2^32 elements, so element numbers fit in 32 bits */
+	const int narrow = def->max_size_bits && def->max_size_bits <= 32;
+
+	/* Use indirect sorting if size is large */
+	if (def->size <= _QSORT_IND_THRESH)
+		return _QSORT_DIRECT;
+	if (def->prefix_cache)
+		return _QSORT_INDIRECT_PREFIX;
+	return narrow ? _QSORT_INDIRECT_OFF32 : _QSORT_INDIRECT_PTR;
+}
+
+/* bytes per index entry in the given indirect mode */
+static __always_inline size_t
+_quicksort_index_entry_size(int indirect) {
+	switch (indirect) {
+	case _QSORT_DIRECT:		return 0;
+	case _QSORT_INDIRECT_OFF32:	return sizeof(uint32_t);
+	case _QSORT_INDIRECT_PREFIX:	return sizeof(struct _quicksort_prefixed);
+	default:			return sizeof(void *);
+	}
+}
+
+/* reverse the elements lo through hi (inclusive) */
+static __always_inline void
+_quicksort_reverse(const struct qsort_def *def, char *lo, char *hi) {
+	for (; lo < hi; lo += def->size, hi -= def->size)
+		_quicksort_swap(def, lo, hi);
+}
+
+/*
+ * _quicksort_presorted -- sort an array in linear time if it is (nearly)
+ *                         presorted
+ * def:         the template parameters
+ * indirect:    one of _QSORT_DIRECT or _QSORT_INDIRECT_*
+ * base:        the array
+ * n:           number of elements (at least 2)
+ *
+ * Measures the run at the start of the array, ascending or strictly
+ * descending (which is reversed). If no more than _QSORT_PRESORTED_TAIL
+ * elements follow it, they are each binary inserted into place.
+ *
+ * Random input will almost always stop the scan within the first couple of
+ * elements, so this costs next to nothing when it doesn't apply.
+ *
+ * Returns non-zero if the array is now sorted.
+ */
+static __always_inline int
+_quicksort_presorted(const struct qsort_def *def, int indirect, char *base,
+		     size_t n, void *arg) {
+	const size_t size = def->size;
+	char *const end = base + n * size;
+	char *run = base + size;
+
+	if (_quicksort_less(def, indirect, run, base, arg)) {
+		while (run + size < end
+		       && _quicksort_less(def, indirect, run + size, run, arg))
+			run += size;
+		run += size;
+
+		if ((size_t)(end - run) > _QSORT_PRESORTED_TAIL * size)
+			return 0;
+		_quicksort_reverse(def, base, run - size);
+	} else {
+		while (run + size < end
+		       && !_quicksort_less(def, indirect, run + size, run, arg))
+			run += size;
+		run += size;
+
+		if ((size_t)(end - run) > _QSORT_PRESORTED_TAIL * size)
+			return 0;
+	}
+
+	for (; run < end; run += size) {
+		char *pos = _quicksort_upper_bound(def, indirect, base, run, run, arg);
+
+		if (pos != run)
+			_quicksort_ror(def, pos, run);
+	}
+
+	return 1;
+}
+
+/* Discontinue quicksort algorithm when partition gets below this size.
+   This particular magic number was chosen to work best on a Sun 4/260. */
+#define MAX_THRESH 4
+
+/* Stack node declarations used to store unfulfilled partition obligations. */
+typedef struct
+  {
+    char *lo;
+    char *hi;
+    size_t depth;
+  } stack_node;
+
+/* The same, as element numbers relative to the start of the array, for arrays
+   that max_size_bits says have fewer than 2^32 elements.  */
+typedef struct
+  {
+    uint32_t lo;
+    uint32_t hi;
+    uint32_t depth;
+  } stack_node32;
+
+/* The next 4 #defines implement a very fast in-line stack abstraction. */
+/* The stack needs log (total_elements) entries (we could even subtract
+   log(MAX_THRESH)).  Since total_elements has type size_t, we get as
+   upper bound for log (total_elements):
+   bits per byte (CHAR_BIT) * sizeof(size_t).
+   However, this results in 1k of stack being allocated on 64 bit machines,
+   which is more than currently reasonable. Thus, for such machines, we'll cap
+   the max entries to 48 bits, or 281 trillion.
+   TODO: Add some mechanism to override this cap?
+   */
+#if (CHAR_BIT * __SIZEOF_SIZE_T__) < 48
+# define STACK_SIZE     (CHAR_BIT * sizeof(size_t))
+#else
+# define STACK_SIZE     48
+#endif
+
+#define STACK_SIZE32	32
+
+#define PUSH(low, high, dep)	(narrow ? PUSH32 (low, high, dep) :		   \
+				 (void) ((top->lo = (low)), (top->hi = (high)),	   \
+					 (top->depth = (dep)), ++top))
+#define	POP(low, high, dep)	(narrow ? POP32 (low, high, dep) :		   \
+				 (void) (--top, (low = top->lo), (high = top->hi), \
+					 (dep = top->depth)))
+#define	STACK_NOT_EMPTY	(narrow ? stack32 < top32 : stack < top)
+
+#define PUSH32(low, high, dep)	((void) ((top32->lo = ((low) - base_ptr) / d.size), \
+					 (top32->hi = ((high) - base_ptr) / d.size), \
+					 (top32->depth = (dep)), ++top32))
+#define	POP32(low, high, dep)	((void) (--top32,				   \
+					 (low = base_ptr + top32->lo * d.size),	   \
+					 (high = base_ptr + top32->hi * d.size),   \
+					 (dep = top32->depth)))
+
+
+/* Order size using quicksort.  This implementation incorporates
+   four optimizations discussed in Sedgewick:
+
+   1. Non-recursive, using an explicit stack of pointer that store the
+      next array partition to sort.  To save time, this maximum amount
+      of space required to store an array of SIZE_MAX is allocated on the
+      stack.  Assuming a 32-bit (64 bit) integer for size_t, this needs
+      only 32 * sizeof(stack_node) == 256 bytes (for 64 bit: 768 bytes,
+      or 1024 bytes if uncapped). Pretty cheap, actually.
+
+   2. Chose the pivot element using a median-of-three decision tree.
+      This reduces the probability of selecting a bad pivot value and
+      eliminates certain extraneous comparisons.
+
+   3. Only quicksorts TOTAL_ELEMS / MAX_THRESH partitions, leaving
+      insertion sort to order the MAX_THRESH items within each partition.
+      This is a big win, since insertion sort is faster for small, mostly
+      sorted array segments.
+
+   4. The larger of the two sub-partitions is always pushed onto the
+      stack first, with the algorithm then concentrating on the
+      smaller partition.  This *guarantees* no more than log (n)
+      stack size is needed (actually O(1) in this case)!
+
+   When def->max_size_bits is 32 or less, the stack holds 32-bit element
+   numbers and large elements are sorted through an index of 32-bit element
+   numbers rather than pointers.
+
+   With def->prefix_cache, large elements are instead sorted through an index
+   of (key prefix, pointer) pairs so that most comparisons never touch the
+   elements themselves.
+
+   With def->adaptive, an array that is already sorted, reversed or sorted
+   but for a short tail is finished off in linear time before any of this.
+
+   When def->introsort is set, each partition also carries its depth and
+   once that exceeds 2 * log2 (n), the partition is heapsorted instead
+   (Musser's introsort), so adversarial input can't drive it to O(n^2).
+
+   When def->partition is QSORT_PARTITION_BLOCK, the Hoare loop is replaced
+   by a branchless block partition and the depth instead counts badly
+   unbalanced partitions (log2 (n) are allowed), as in pdqsort.
+
+   With QSORT_PARTITION_THREE_WAY (or def->three_way_adaptive and equal keys
+   in the median-of-three sample), keys equal to the pivot are gathered in
+   the middle and left out of both sub-partitions.
+
+   With def->network, partitions of up to _QSORT_NETWORK_MAX elements are
+   sorted by a sorting network as they are split off and the final insertion
+   sort is skipped.  A whole array that small goes straight to the network
+   without being partitioned.  */
+
+static __always_inline __flatten int
+qsort_template (const struct qsort_def *def, void *const pbase,
+                size_t n, void *arg)
+{
+  /* this copy of def will be mutated to manage indirect sorting if needed */
+  struct qsort_def d = *def;
+  char *base_ptr = (char *) pbase;
+  size_t max_thresh;
+  size_t max_unsplit;              /* ct const */
+
+  /* The real size allocated is MAX_TMP_STACK_SIZE + d.align - 1. This space is
+   * in addition to the 256 to 768 (or 1024 if uncapped) bytes used in the
+   * primary loop. */
+  const size_t MAX_TMP_STACK_SIZE = 512;
+  int elem_buf_on_heap = 0;        /* ct const */
+  int index_on_heap    = 0;        /* ct const */
+  int indirect;                    /* ct const */
+  int narrow;                      /* ct const */
+  int block            = d.partition == QSORT_PARTITION_BLOCK; /* ct const */
+  int three_way        = d.partition == QSORT_PARTITION_THREE_WAY; /* ct const */
+  int network          = _quicksort_network_ok (&d); /* ct const */
+  size_t tmp_needed    = 0;        /* both (can result in either ct or rt value) */
+  int ret              = 0;
+
+  if (n == 0)
+    /* Avoid lossage with unsigned arithmetic below.  */
+    return 0;
+
+  /* Restrict to reasonable value */
+  if (d.align > _QSORT_ALIGN_MAX)
+    d.align = _QSORT_ALIGN_MAX;
+
+  if (!d.max_size_bits)
+    d.max_size_bits = sizeof(size_t) * 8 * 4 / 3;
+
+  if (!d.max_thresh)
+    d.max_thresh = 4;
+
+  if (!d.max_stack_space)
+    d.max_stack_space = 1024;
+
+  /* fewer than 2^32 elements, so element numbers fit in 32 bits */
+  narrow = d.max_size_bits <= 32;
+  indirect = _quicksort_indirect_mode (&d);
+
+  /* at most 2^max_size_bits - 1 elements */
+  if (narrow && d.max_size_bits < sizeof (size_t) * 8 && n >> d.max_size_bits)
+    return EINVAL;
+
+  assert_const(!!d.less);
+  assert_const(d.align + d.size);
+  BUILD_BUG_ON_MSG(!d.less, "less function is required");
+  BUILD_BUG_ON_MSG(d.prefix_cache && !d.prefix && !d.key_width && !d.keys,
+                   "prefix_cache requires a prefix function or key");
+
+#if __STDC_VERSION__ >= 201112L
+  BUILD_BUG_ON_MSG(_Alignof(max_align_t) & (_Alignof(max_align_t) - 1),
+                   "_Alignof(max_align_t) is not a power of two");
+#endif
+
+  BUILD_BUG_ON_MSG(d.align & (d.align - 1), "align must be a power of two");
+  BUILD_BUG_ON_MSG(d.size % d.align, "size must be a multiple of align");
+
+  /* verify pbase is really aligned as advertised */
+  assert_early(!((uintptr_t)pbase & (d.align - 1)));
+
+  if (!d.elem_buf)
+    tmp_needed += def->size;
+
+  if (d.size > _QSORT_IND_THRESH || !d.index)
+    tmp_needed += _quicksort_index_entry_size (indirect) * n;
+
+  /* if we don't already have a temp element buffer allocate one now */
+  if (!d.elem_buf)
+    {
+      /* try to get an aligned d.elem_buf buffer the as large as size */
+      if (d.size > MAX_TMP_STACK_SIZE)
+        {
+          /* FIXME: pre C11 compat */
+          d.elem_buf = aligned_alloc(d.align, d.size);
+          elem_buf_on_heap = 1;
+
+          if (!d.elem_buf)
+            return ENOMEM;
+        }
+      else
+        {
+          size_t offset;
+          /* put it on the stack */
+          d.elem_buf = alloca (d.size + d.align - 1);
+
+          /* align it */
+          offset = (uintptr_t)d.elem_buf % d.align;
           if (offset)
             d.elem_buf = (char *)d.elem_buf + d.align - offset;
         }
     }
 
-  if (indirect)
-    {
-      size_t i;
+  if (indirect)
+    {
+      const size_t index_elem_size = _quicksort_index_entry_size (indirect);
+      uint64_t start_ns;
+      size_t i;
+
+      d.size = index_elem_size;
+      d.align = indirect == _QSORT_INDIRECT_PREFIX ? _Alignof(struct _quicksort_prefixed)
+              : indirect == _QSORT_INDIRECT_OFF32  ? _Alignof(uint32_t)
+                                                   : _Alignof(void *);
+
+      if (!d.index)
+        {
+          index_on_heap = 1;
+          d.index = malloc(index_elem_size * n);
+          if (!d.index)
+            {
+              ret = ENOMEM;
+              goto exit_free_elem_buf;
+            }
+        }
+
+      assert(!((uintptr_t)d.index & (d.align - 1)));
+
+      start_ns = d.stats ? _quicksort_now_ns () : 0;
+
+      if (indirect == _QSORT_INDIRECT_OFF32)
+        {
+          uint32_t *index32 = (uint32_t *) d.index;
+
+          d.ind_base = base_ptr;
+          d.ind_size = def->size;
+          for (i = n; i--;)
+            index32[i] = i;
+        }
+      else if (indirect == _QSORT_INDIRECT_PREFIX)
+        {
+          struct _quicksort_prefixed *entries = (void *) d.index;
+
+          for (i = n; i--;)
+            {
+              char *p = base_ptr + i * def->size;
+
+              entries[i].prefix = def->prefix ? def->prefix (p, arg)
+                                : def->key_width ? _quicksort_key_bits (def, p)
+                                : _quicksort_key_word (def, p, 0);
+              entries[i].elem = p;
+            }
+        }
+      else
+        for (i = n; i--;)
+          d.index[i] = base_ptr + i * def->size;
+      base_ptr = (char *) d.index;
+
+      _QSORT_STAT_ADD (&d, index_ns, _quicksort_now_ns () - start_ns);
+
+//  printf("pbase = %p, base_ptr = %p, d.elem_buf = %p, d.index = %p\n", pbase, base_ptr, d.elem_buf, d.index);
+    }
+
+  /* now that we're certain about d.size... */
+  max_thresh = (network ? _QSORT_NETWORK_MAX - 1 : MAX_THRESH) * d.size;
+  /* the most elements left unpartitioned: a whole network's worth, as for
+     the partitions max_thresh (a distance between their ends) lets through */
+  max_unsplit = network ? _QSORT_NETWORK_MAX : MAX_THRESH;
+
+
+  /* These locals should still be compile-time constants */
+  assert_const(elem_buf_on_heap);
+  assert_const(index_on_heap);
+  assert_const(indirect);
+  assert_const(narrow);
+  assert_const(block);
+  assert_const(three_way);
+  assert_const(network);
+  assert_const(max_thresh);
+  assert_const(max_unsplit);
+
+  if (d.adaptive && n > 1 && _quicksort_presorted (&d, indirect, base_ptr, n, arg))
+    goto sorted;
+
+  if (n > max_unsplit)
+    {
+      char *lo = base_ptr;
+      char *hi = &lo[d.size * (n - 1)];
+      stack_node stack[STACK_SIZE];
+      stack_node *top = stack;
+      stack_node32 stack32[STACK_SIZE32];
+      stack_node32 *top32 = stack32;
+      /* 2 * floor (log2 (n)), or just log2 (n) bad partitions for block */
+      size_t depth = (block ? 1 : 2)
+                     * (sizeof (size_t) * CHAR_BIT - 1 - __builtin_clzl (n));
+
+      PUSH (lo, hi, 0);
+
+      while (STACK_NOT_EMPTY)
+        {
+          char *left_ptr;
+          char *right_ptr;
+          int fat_pivot = three_way;
+
+          _QSORT_STAT_MAX (&d, max_stack, narrow ? top32 - stack32 : top - stack);
+
+          if (block ? !depth : d.introsort && !depth--)
+            {
+              /* Too many bad pivots, fall back to heapsort. */
+              _quicksort_heapsort (&d, indirect, lo, hi, arg);
+              POP (lo, hi, depth);
+              continue;
+            }
+
+          _QSORT_STAT_ADD (&d, partitions, 1);
+
+          /* Select median value from among LO, MID, and HI. Rearrange
+             LO and HI so the three values are sorted. This lowers the
+             probability of picking a pathological pivot value and
+             skips a comparison for both the LEFT_PTR and RIGHT_PTR in
+             the while loops. */
+
+          char *mid = lo + d.size * ((hi - lo) / d.size >> 1);
+
+          if (d.pivot && (size_t) (hi - lo) / d.size >= _QSORT_NINTHER_THRESH)
+            /* Larger partitions can afford a bigger sample. */
+            _quicksort_pivot_sampled (&d, indirect, lo, mid, hi, arg);
+          else
+            {
+              if (_quicksort_less (&d, indirect, (void *) mid, (void *) lo, arg))
+                _quicksort_swap (&d, mid, lo);
+              if (_quicksort_less (&d, indirect, (void *) hi, (void *) mid, arg))
+                _quicksort_swap (&d, mid, hi);
+              else
+                goto jump_over;
+              if (_quicksort_less (&d, indirect, (void *) mid, (void *) lo, arg))
+                _quicksort_swap (&d, mid, lo);
+            jump_over:
+              ;
+            }
+
+          /* Duplicates in the sample suggest many more in the partition. */
+          if (!fat_pivot && d.three_way_adaptive)
+            fat_pivot = !_quicksort_less (&d, indirect, (void *) lo, (void *) mid, arg)
+                        || !_quicksort_less (&d, indirect, (void *) mid, (void *) hi, arg);
+
+          if (fat_pivot)
+            {
+              _quicksort_swap (&d, lo, mid);
+              _quicksort_partition_three_way (&d, indirect, lo, hi,
+                                              &right_ptr, &left_ptr, arg);
+            }
+          else if (block)
+            {
+              char *pivot_pos;
+              size_t l_size, r_size;
+              int already_partitioned;
+
+              /* move the pivot out of the way */
+              _quicksort_swap (&d, lo, mid);
+              pivot_pos = _quicksort_partition_block (&d, indirect, lo, hi,
+                                                      &already_partitioned, arg);
+              l_size = (size_t) (pivot_pos - lo) / d.size;
+              r_size = (size_t) (hi - pivot_pos) / d.size;
+
+              right_ptr = pivot_pos - d.size;
+              left_ptr  = pivot_pos + d.size;
+
+              if (l_size < (l_size + r_size) / 8
+                  || r_size < (l_size + r_size) / 8)
+                {
+                  /* Bad partition: count it and shuffle things up. */
+                  --depth;
+                  _quicksort_break_patterns (&d, lo, pivot_pos, hi);
+                }
+              else if (already_partitioned)
+                {
+                  /* Nothing moved, so the input may be (nearly) sorted.
+                     Mark any side that a partial insertion sort finishes
+                     off as empty. */
+                  if (_quicksort_partial_insertion (&d, indirect, lo,
+                                                    right_ptr, arg))
+                    right_ptr = lo - d.size;
+                  if (_quicksort_partial_insertion (&d, indirect, left_ptr,
+                                                    hi, arg))
+                    left_ptr = hi + d.size;
+                }
+            }
+          else
+            {
+              left_ptr  = lo + d.size;
+              right_ptr = hi - d.size;
+
+              /* Here's the famous ``collapse the walls'' section of quicksort.
+                 Gotta like those tight inner loops!  They are the main reason
+                 that this algorithm runs much faster than others. */
+              do
+                {
+                  while (_quicksort_less (&d, indirect, (void *) left_ptr, (void *) mid, arg))
+                    left_ptr += d.size;
+
+                  while (_quicksort_less (&d, indirect, (void *) mid, (void *) right_ptr, arg))
+                    right_ptr -= d.size;
+
+                  if (left_ptr < right_ptr)
+                    {
+                      _quicksort_swap (&d, left_ptr, right_ptr);
+                      if (mid == left_ptr)
+                        mid = right_ptr;
+                      else if (mid == right_ptr)
+                        mid = left_ptr;
+                      left_ptr += d.size;
+                      right_ptr -= d.size;
+                    }
+                  else if (left_ptr == right_ptr)
+                    {
+                      left_ptr += d.size;
+                      right_ptr -= d.size;
+                      break;
+                    }
+                }
+              while (left_ptr <= right_ptr);
+            }
+
+          /* How evenly that split the partition. */
+          _QSORT_STAT_ADD (&d, partition_elems, (size_t) (hi - lo) / d.size + 1);
+          _QSORT_STAT_ADD (&d, partition_minor,
+                           min (right_ptr < lo ? 0 : (size_t) (right_ptr - lo) / d.size + 1,
+                                left_ptr > hi ? 0 : (size_t) (hi - left_ptr) / d.size + 1));
+
+          /* Set up pointers for next iteration.  First determine whether
+             left and right partitions are below the threshold size.  If so,
+             ignore one or both.  Otherwise, push the larger partition's
+             bounds on the stack and continue sorting the smaller one.
+             Either partition may be empty (the pointers having crossed its
+             end), hence the signed comparisons. */
+
+          if (network)
+            {
+              /* Finish off small partitions now, while they're in cache. */
+              if (right_ptr > lo && right_ptr - lo <= (ptrdiff_t) max_thresh)
+                _quicksort_network (&d, lo, (size_t) (right_ptr - lo) / d.size + 1);
+              if (hi > left_ptr && hi - left_ptr <= (ptrdiff_t) max_thresh)
+                _quicksort_network (&d, left_ptr, (size_t) (hi - left_ptr) / d.size + 1);
+            }
+
+          if (right_ptr - lo <= (ptrdiff_t) max_thresh)
+            {
+              if (hi - left_ptr <= (ptrdiff_t) max_thresh)
+                /* Ignore both small partitions. */
+                POP (lo, hi, depth);
+              else
+                /* Ignore small left partition. */
+                lo = left_ptr;
+            }
+          else if (hi - left_ptr <= (ptrdiff_t) max_thresh)
+            /* Ignore small right partition. */
+            hi = right_ptr;
+          else if ((right_ptr - lo) > (hi - left_ptr))
+            {
+              /* Push larger left partition indices. */
+              PUSH (lo, right_ptr, depth);
+              lo = left_ptr;
+            }
+          else
+            {
+              /* Push larger right partition indices. */
+              PUSH (left_ptr, hi, depth);
+              hi = right_ptr;
+            }
+        }
+    }
+
+  /* Once the BASE_PTR array is partially sorted by quicksort the rest
+     is completely sorted using insertion sort, since this is efficient
+     for partitions below MAX_THRESH size. BASE_PTR points to the beginning
+     of the array to sort, and END_PTR points at the very last element in
+     the array (*not* one beyond it!). */
+
+
+  if (network)
+    {
+      /* Every partition has already been sorted, unless the array was too
+         small to partition at all. */
+      if (n <= max_unsplit)
+        _quicksort_network (&d, base_ptr, n);
+    }
+  /* if element size is a power of two, indexed addressing will be more
+   * efficient in most cases */
+  else if (d.size <= _QSORT_ARCH_MAX_INDEX_MULT || !(d.size & (d.size - 1)))
+    {
+      const size_t thresh = min (n, MAX_THRESH + 1);
+      size_t left, right;
+      void *smallest;
+
+      /* Find smallest element in first threshold and place it at the
+          array's beginning.  This is the smallest array element,
+          and the operation speeds up insertion sort's inner loop. */
+
+      for (smallest = base_ptr, right = 1; right < thresh; ++right)
+        {
+          char *p = base_ptr + right * d.size;
+
+          if (_quicksort_less (&d, indirect, p, smallest, arg))
+            smallest = p;
+        }
+
+      if (smallest != base_ptr)
+        _quicksort_swap (&d, smallest, base_ptr);
+
+      for (right = 2; right < n; ++right)
+        {
+          if (d.binary_insertion)
+            left = (size_t) (_quicksort_insertion_point (&d, indirect, base_ptr,
+                                                         &base_ptr[right * d.size], arg)
+                             - base_ptr) / d.size;
+          else
+            {
+              left = right - 1;
+              while (_quicksort_less (&d, indirect, &base_ptr[right * d.size], &base_ptr[left * d.size], arg))
+                {
+                  assert(left);
+                  --left;
+                }
+
+              ++left;
+            }
+          if (left != right)
+            _quicksort_ror(&d, &base_ptr[left * d.size], &base_ptr[right * d.size]);
+        }
+    }
+  else
+    {
+      /* if not a power of two, use ptr arithmetic */
+      char *const end_ptr = &base_ptr[d.size * (n - 1)];
+      char *tmp_ptr = base_ptr;
+      char *thresh = min(end_ptr, base_ptr + max_thresh);
+      register char *run_ptr;
+
+      /* Find smallest element in first threshold and place it at the
+         array's beginning.  This is the smallest array element,
+         and the operation speeds up insertion sort's inner loop. */
+
+      for (run_ptr = tmp_ptr + d.size; run_ptr <= thresh; run_ptr += d.size)
+        if (_quicksort_less (&d, indirect, (void *) run_ptr, (void *) tmp_ptr, arg))
+          tmp_ptr = run_ptr;
+
+      if (tmp_ptr != base_ptr)
+        _quicksort_swap (&d, tmp_ptr, base_ptr);
+
+      /* Insertion sort, running from left-hand-side up to right-hand-side.  */
+
+      run_ptr = base_ptr + d.size;
+      while ((run_ptr += d.size) <= end_ptr)
+        {
+          if (d.binary_insertion)
+            tmp_ptr = _quicksort_insertion_point (&d, indirect, base_ptr,
+                                                  run_ptr, arg);
+          else
+            {
+              tmp_ptr = run_ptr - d.size;
+              while (_quicksort_less (&d, indirect, (void *) run_ptr, (void *) tmp_ptr, arg))
+                tmp_ptr -= d.size;
+
+              tmp_ptr += d.size;
+            }
+          if (tmp_ptr != run_ptr)
+            _quicksort_ror(&d, tmp_ptr, run_ptr);
+        }
+    }
+
+
+sorted:
+  /* if we used indirect sorting, now we have to re-arrange the array (or
+     gather a sorted copy of it). */
+  if (indirect && d.copy_dst)
+    _quicksort_gather (def, indirect, d.copy_dst, d.index, pbase, n);
+  else if (indirect == _QSORT_INDIRECT_OFF32)
+    _quicksort_permute32 (def, pbase, (uint32_t *) d.index, n, d.elem_buf);
+  else if (indirect == _QSORT_INDIRECT_PREFIX)
+    {
+      const struct _quicksort_prefixed *entries = (void *) d.index;
+      size_t i;
+
+      /* Compact the pointers in place, as radix_sort_template does. */
+      for (i = 0; i < n; ++i)
+        d.index[i] = entries[i].elem;
+
+      _quicksort_permute (def, pbase, d.index, n, d.elem_buf);
+    }
+  else if (indirect)
+    _quicksort_permute (def, pbase, d.index, n, d.elem_buf);
+
+  if (index_on_heap)
+    free (d.index);
+
+exit_free_elem_buf:
+  if (elem_buf_on_heap)
+    free (d.elem_buf);
+
+  return ret;
+}
+
+/**
+ * qsort_copy_template - sort an array into a separate destination
+ * @def: the template parameters
+ * @src: the array, which is left unchanged
+ * @dst: room for n elements, aligned like src and not overlapping it
+ * @n:   number of elements
+ * @arg: passed to def->less
+ *
+ * Elements small enough to be sorted directly are copied to dst and sorted
+ * there. Larger ones are sorted through an index, as qsort_template does,
+ * and then gathered from src straight into dst in one sequential pass rather
+ * than being copied and permuted into place.
+ *
+ * Returns zero on success, ENOMEM or EINVAL (see qsort_template).
+ */
+static __always_inline __flatten int
+qsort_copy_template (const struct qsort_def *def, const void *src, void *dst,
+                     size_t n, void *arg)
+{
+  struct qsort_def d = *def;
+
+  if (!_quicksort_indirect_mode (def))
+    {
+      memcpy (dst, src, n * def->size);
+      return qsort_template (def, dst, n, arg);
+    }
+
+  d.copy_dst = dst;
+  return qsort_template (&d, (void *) src, n, arg);
+}
+
+/**
+ * struct qsort_ctx - reusable scratch space for qsort_ctx_template
+ * @alloc:     allocates size bytes aligned to align (a power of two that
+ *             divides size), or returns NULL
+ * @free:      releases memory from alloc
+ * @alloc_arg: passed to alloc and free
+ * @buf:       the scratch space
+ * @capacity:  size of buf in bytes
+ * @align:     alignment of buf
+ *
+ * Scratch space only ever grows, so once a context has sorted the largest
+ * array it will see, further sorts don't touch the allocator at all. A
+ * context may be set up with QSORT_CTX_INIT (backed by aligned_alloc) or
+ * with qsort_ctx_init to supply other callbacks. If alloc is NULL, buf is
+ * a fixed arena supplied by the caller and sorts needing more than capacity
+ * bytes fail with ENOMEM.
+ *
+ * Contexts have no locking: use one per thread.
+ */
+struct qsort_ctx {
+	void *(*alloc)(size_t align, size_t size, void *alloc_arg);
+	void (*free)(void *p, void *alloc_arg);
+	void *alloc_arg;
+	void *buf;
+	size_t capacity;
+	size_t align;
+};
+
+static inline void *
+_qsort_ctx_aligned_alloc(size_t align, size_t size, void *alloc_arg) {
+	return aligned_alloc(align, size);
+}
+
+static inline void
+_qsort_ctx_free(void *p, void *alloc_arg) {
+	free(p);
+}
+
+#define QSORT_CTX_INIT {					\
+	.alloc = _qsort_ctx_aligned_alloc,			\
+	.free  = _qsort_ctx_free,				\
+}
+
+/**
+ * qsort_ctx_init - set up a context with the given allocator
+ * @ctx:       the context
+ * @alloc_fn:  allocator, or NULL to use aligned_alloc
+ * @free_fn:   releases memory from alloc_fn, or NULL to use free
+ * @alloc_arg: passed to alloc and free
+ */
+static inline void
+qsort_ctx_init(struct qsort_ctx *ctx,
+	       void *(*alloc_fn)(size_t align, size_t size, void *alloc_arg),
+	       void (*free_fn)(void *p, void *alloc_arg), void *alloc_arg) {
+	ctx->alloc     = alloc_fn ? alloc_fn : _qsort_ctx_aligned_alloc;
+	ctx->free      = free_fn ? free_fn : _qsort_ctx_free;
+	ctx->alloc_arg = alloc_arg;
+	ctx->buf       = NULL;
+	ctx->capacity  = 0;
+	ctx->align     = 0;
+}
+
+/**
+ * qsort_ctx_init_arena - set up a context over a fixed, caller owned buffer
+ * @ctx:      the context
+ * @buf:      the buffer
+ * @capacity: its size in bytes
+ * @align:    its alignment
+ */
+static inline void
+qsort_ctx_init_arena(struct qsort_ctx *ctx, void *buf, size_t capacity,
+		     size_t align) {
+	ctx->alloc     = NULL;
+	ctx->free      = NULL;
+	ctx->alloc_arg = NULL;
+	ctx->buf       = buf;
+	ctx->capacity  = capacity;
+	ctx->align     = align;
+}
+
+/**
+ * qsort_ctx_destroy - release a context's scratch space
+ */
+static inline void
+qsort_ctx_destroy(struct qsort_ctx *ctx) {
+	if (ctx->alloc && ctx->buf)
+		ctx->free(ctx->buf, ctx->alloc_arg);
+	ctx->buf = NULL;
+	ctx->capacity = 0;
+}
+
+/**
+ * qsort_ctx_reserve - make sure a context has at least bytes of scratch space
+ *                     aligned to align
+ *
+ * Returns zero on success or ENOMEM, in which case the old space is kept.
+ */
+static inline int
+qsort_ctx_reserve(struct qsort_ctx *ctx, size_t bytes, size_t align) {
+	size_t capacity;
+	void *buf;
+
+	if (bytes <= ctx->capacity && align <= ctx->align)
+		return 0;
+
+	if (!ctx->alloc)
+		return ENOMEM;
+
+	if (align < ctx->align)
+		align = ctx->align;
+
+	/* grow geometrically so a slowly growing n doesn't realloc each time */
+	capacity = bytes > ctx->capacity * 2 ? bytes : ctx->capacity * 2;
+	capacity = (capacity + align - 1) & ~(align - 1);
+
+	buf = ctx->alloc(align, capacity, ctx->alloc_arg);
+	if (!buf)
+		return ENOMEM;
+
+	if (ctx->buf)
+		ctx->free(ctx->buf, ctx->alloc_arg);
+	ctx->buf      = buf;
+	ctx->capacity = capacity;
+	ctx->align    = align;
+	return 0;
+}
+
+/**
+ * qsort_ctx_template - qsort_template using a context's scratch space
+ * @def:   the template parameters
+ * @ctx:   the context
+ * @pbase: the array
+ * @n:     number of elements
+ * @arg:   passed to def->less
+ *
+ * All the scratch space the sort needs (the element buffer and, for large
+ * elements, the index) is reserved from ctx before the array is touched, so
+ * ENOMEM is returned up front and qsort_template itself never allocates.
+ *
+ * Returns zero on success, ENOMEM or EINVAL (see qsort_def::max_size_bits).
+ */
+static __always_inline __flatten int
+qsort_ctx_template (const struct qsort_def *def, struct qsort_ctx *ctx,
+                    void *const pbase, size_t n, void *arg)
+{
+  struct qsort_def d = *def;
+  const int indirect = _quicksort_indirect_mode (def); /* ct const */
+  const int need_elem_buf = !def->elem_buf;            /* ct const */
+  const int need_index = indirect && !def->index;      /* ct const */
+  size_t align = min (def->align, _QSORT_ALIGN_MAX);
+  size_t elem_bytes = 0;
+  size_t index_bytes = 0;
+  char *buf;
+  int ret;
+
+  assert_const(indirect);
+  assert_const(need_elem_buf);
+  assert_const(need_index);
+
+  if (n <= 1)
+    return 0;
+
+  if (!need_elem_buf && !need_index)
+    return qsort_template (&d, pbase, n, arg);
+
+  if (need_index)
+    {
+      index_bytes = _quicksort_index_entry_size (indirect) * n;
+      if (align < _Alignof (struct _quicksort_prefixed))
+        align = _Alignof (struct _quicksort_prefixed);
+    }
+
+  /* the element buffer goes first, so it keeps the array's alignment */
+  if (need_elem_buf)
+    elem_bytes = (def->size + align - 1) & ~(align - 1);
+
+  ret = qsort_ctx_reserve (ctx, elem_bytes + index_bytes, align);
+  if (ret)
+    return ret;
+
+  /* also lets qsort_template see that it needn't allocate */
+  buf = ctx->buf;
+  if (!buf)
+    return ENOMEM;
+
+  if (need_elem_buf)
+    d.elem_buf = buf;
+  if (need_index)
+    d.index = (void **) (buf + elem_bytes);
+
+  return qsort_template (&d, pbase, n, arg);
+}
+
+/*
+ * _msort_insertion -- stable insertion sort of n elements
+ */
+static __always_inline void
+_msort_insertion(const struct qsort_def *def, int indirect, char *base,
+		 size_t n, void *arg) {
+	const size_t size = def->size;
+	char *const end = base + n * size;
+	char *cur;
+
+	for (cur = base + size; cur < end; cur += size) {
+		char *sift = cur;
+
+		/* strictly less, so equal elements keep their order */
+		if (def->binary_insertion)
+			sift = _quicksort_insertion_point(def, indirect, base, cur, arg);
+		else
+			while (sift != base && _quicksort_less(def, indirect, cur, sift - size, arg))
+				sift -= size;
+
+		if (sift != cur)
+			_quicksort_ror(def, sift, cur);
+	}
+}
+
+/*
+ * _msort_merge -- stably merge the sorted ranges [lo, mid) and [mid, hi)
+ *                 into dst
+ */
+static __always_inline void
+_msort_merge(const struct qsort_def *def, int indirect, char *dst,
+	     const char *lo, const char *mid, const char *hi, void *arg) {
+	const size_t size = def->size;
+	const char *l = lo;
+	const char *r = mid;
+
+	/* already in order, nothing to interleave */
+	if (l == mid || r == hi
+	    || !_quicksort_less(def, indirect, (void *)r, (void *)(r - size), arg)) {
+		memcpy(dst, lo, hi - lo);
+		return;
+	}
+
+	while (l < mid && r < hi) {
+		/* take from the right only if strictly less, for stability */
+		if (_quicksort_less(def, indirect, (void *)r, (void *)l, arg)) {
+			_quicksort_copy(def, dst, r);
+			r += size;
+		} else {
+			_quicksort_copy(def, dst, l);
+			l += size;
+		}
+		dst += size;
+	}
+
+	if (l < mid)
+		memcpy(dst, l, mid - l);
+	else if (r < hi)
+		memcpy(dst, r, hi - r);
+}
+
+/*
+ * _msort_core -- bottom-up stable merge sort
+ * def:         the template parameters of the items being moved (pointers
+ *              when indirect)
+ * base:        the array
+ * buf:         scratch space for n items
+ * n:           number of items
+ *
+ * Runs of _QSORT_MSORT_RUN items are insertion sorted in place, then merged
+ * pairwise back and forth between base and buf, with a final copy back into
+ * base if the last pass left them in buf.
+ */
+static __always_inline void
+_msort_core(const struct qsort_def *def, int indirect, char *base, char *buf,
+	    size_t n, void *arg) {
+	const size_t size = def->size;
+	const size_t bytes = n * size;
+	char *src = base;
+	char *dst = buf;
+	size_t width, i;
+
+	for (i = 0; i < n; i += _QSORT_MSORT_RUN)
+		_msort_insertion(def, indirect, base + i * size,
+				 min(n - i, (size_t)_QSORT_MSORT_RUN), arg);
+
+	for (width = _QSORT_MSORT_RUN * size; width < bytes; width *= 2) {
+		char *tmp;
+
+		for (i = 0; i < bytes; i += 2 * width) {
+			const size_t mid = min(i + width, bytes);
+			const size_t hi  = min(i + 2 * width, bytes);
+
+			_msort_merge(def, indirect, dst + i, src + i, src + mid,
+				     src + hi, arg);
+		}
+
+		tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+
+	if (src != base)
+		memcpy(base, src, bytes);
+}
+
+/*
+ * _msort_merge_lo -- stably merge [l, l_end), a copy of the run just before
+ *                    [r, r_end), with that run into dst (where the first run
+ *                    used to start)
+ *
+ * The write position never overtakes r, so the right run is merged in place
+ * and whatever is left of it at the end is already where it belongs.
+ */
+static __always_inline void
+_msort_merge_lo(const struct qsort_def *def, int indirect, char *dst,
+		const char *l, const char *l_end, const char *r,
+		const char *r_end, void *arg) {
+	const size_t size = def->size;
+
+	while (l < l_end && r < r_end) {
+		if (_quicksort_less(def, indirect, (void *)r, (void *)l, arg)) {
+			_quicksort_copy(def, dst, r);
+			r += size;
+		} else {
+			_quicksort_copy(def, dst, l);
+			l += size;
+		}
+		dst += size;
+	}
+
+	if (l < l_end)
+		memcpy(dst, l, l_end - l);
+}
+
+/* TimSort's minimum run length: n / 2^k rounded up, for k that puts it
+ * between _QSORT_MSORT_MINRUN and twice that */
+static __always_inline size_t
+_msort_minrun(size_t n) {
+	size_t r = 0;
+
+	while (n >= 2 * _QSORT_MSORT_MINRUN) {
+		r |= n & 1;
+		n >>= 1;
+	}
+
+	return n + r;
+}
+
+/*
+ * _msort_natural -- stable natural merge sort (TimSort without galloping)
+ * def:         the template parameters of the items being moved (pointers
+ *              when indirect)
+ * base:        the array
+ * buf:         scratch space for n items
+ * n:           number of items
+ *
+ * Ascending runs are used as they are and strictly descending ones (which
+ * can't contain equal items to be kept in order) are reversed. Runs shorter
+ * than _msort_minrun (n) are extended with an insertion sort. Pending runs
+ * are kept on a stack whose lengths shrink at least as fast as the Fibonacci
+ * numbers, merging as needed to keep it that way, so merges stay balanced
+ * and the stack stays small. Sorted input costs n - 1 comparisons.
+ */
+static __always_inline void
+_msort_natural(const struct qsort_def *def, int indirect, char *base,
+	       char *buf, size_t n, void *arg) {
+	const size_t size = def->size;
+	const size_t minrun = _msort_minrun(n);
+	struct {
+		char *start;
+		size_t len;
+	} runs[96];
+	size_t top = 0;
+	size_t i = 0;
+
+	while (i < n) {
+		char *const start = base + i * size;
+		size_t len = 1;
+
+		if (i + 1 < n) {
+			if (_quicksort_less(def, indirect, start + size, start, arg)) {
+				len = 2;
+				while (i + len < n
+				       && _quicksort_less(def, indirect, start + len * size,
+							  start + (len - 1) * size, arg))
+					++len;
+				_quicksort_reverse(def, start, start + (len - 1) * size);
+			} else {
+				len = 2;
+				while (i + len < n
+				       && !_quicksort_less(def, indirect, start + len * size,
+							   start + (len - 1) * size, arg))
+					++len;
+			}
+		}
+
+		if (len < minrun) {
+			len = min(minrun, n - i);
+			_msort_insertion(def, indirect, start, len, arg);
+		}
+
+		assert(top < sizeof(runs) / sizeof(*runs));
+		runs[top].start = start;
+		runs[top++].len = len;
+		i += len;
+
+		/* merge until the stack invariants hold, or everything if done */
+		while (top > 1) {
+			size_t at = top - 2;
+
+			if (i < n) {
+				if ((top > 2 && runs[top - 3].len <= runs[top - 2].len + runs[top - 1].len)
+				    || (top > 3 && runs[top - 4].len <= runs[top - 3].len + runs[top - 2].len)) {
+					if (runs[top - 3].len < runs[top - 1].len)
+						at = top - 3;
+				} else if (runs[top - 2].len > runs[top - 1].len) {
+					break;
+				}
+			}
+
+			{
+				char *const l = runs[at].start;
+				char *const r = runs[at + 1].start;
+				char *const r_end = r + runs[at + 1].len * size;
+				char *l_start = l;
+
+				/* skip what is already in place */
+				l_start = _quicksort_upper_bound(def, indirect, l, r, r, arg);
+				if (l_start < r) {
+					memcpy(buf, l_start, r - l_start);
+					_msort_merge_lo(def, indirect, l_start, buf,
+							buf + (r - l_start), r, r_end, arg);
+				}
+
+				runs[at].len += runs[at + 1].len;
+				if (at + 2 < top)
+					runs[at + 1] = runs[at + 2];
+				--top;
+			}
+		}
+	}
+}
+
+/**
+ * msort_template - stable merge sort using the same template definitions as
+ *                  qsort_template
+ * @def:   the template parameters
+ * @pbase: the array
+ * @n:     number of elements
+ * @arg:   passed to def->less
+ *
+ * Elements larger than _QSORT_IND_THRESH are sorted indirectly, through an
+ * index of pointers (def->index if supplied), and then permuted into place.
+ * Scratch space for merging comes from def->merge_buf if supplied. With
+ * def->adaptive, the natural runs of the input are merged instead of fixed
+ * size ones.
+ *
+ * Returns zero on success or ENOMEM.
+ */
+static __always_inline __flatten int
+msort_template (const struct qsort_def *def, void *const pbase, size_t n,
+                void *arg)
+{
+  struct qsort_def d = *def;
+  const int indirect = def->size > _QSORT_IND_THRESH; /* ct const */
+  /* room for one (direct) element or pointer, for _quicksort_ror */
+  char elem_buf[_QSORT_IND_THRESH] __aligned(_QSORT_ALIGN_MAX);
+  size_t align = min (def->align, _QSORT_ALIGN_MAX);
+  size_t elem_bytes = 0, index_bytes = 0, merge_bytes = 0;
+  char *scratch = NULL;
+  char *p;
+
+  assert_const(indirect);
+
+  if (n <= 1)
+    return 0;
+
+  if (indirect)
+    {
+      /* the real elements need a full sized buffer for the permutation */
+      if (!d.elem_buf)
+        elem_bytes = (def->size + _Alignof (void *) - 1)
+                     & ~(_Alignof (void *) - 1);
+      if (!d.index)
+        index_bytes = n * sizeof (void *);
+      if (!d.merge_buf)
+        merge_bytes = n * sizeof (void *);
+      if (align < _Alignof (void *))
+        align = _Alignof (void *);
+    }
+  else if (!d.merge_buf)
+    merge_bytes = n * def->size;
+
+  if (elem_bytes + index_bytes + merge_bytes)
+    {
+      scratch = aligned_alloc (align, (elem_bytes + index_bytes + merge_bytes
+                                       + align - 1) & ~(align - 1));
+      if (!scratch)
+        return ENOMEM;
+
+      p = scratch;
+      if (elem_bytes)
+        {
+          d.elem_buf = p;
+          p += elem_bytes;
+        }
+      if (index_bytes)
+        {
+          d.index = (void **) p;
+          p += index_bytes;
+        }
+      if (merge_bytes)
+        d.merge_buf = p;
+    }
+
+  if (indirect)
+    {
+      struct qsort_def id = d;
+      size_t i;
+
+      for (i = 0, p = pbase; i < n; ++i, p += def->size)
+        d.index[i] = p;
+
+      id.size     = sizeof (void *);
+      id.align    = _Alignof (void *);
+      id.elem_buf = elem_buf;
+      if (d.adaptive)
+        _msort_natural (&id, 1, (char *) d.index, d.merge_buf, n, arg);
+      else
+        _msort_core (&id, 1, (char *) d.index, d.merge_buf, n, arg);
+      _quicksort_permute (def, pbase, d.index, n, d.elem_buf);
+    }
+  else
+    {
+      d.elem_buf = elem_buf;
+      if (d.adaptive)
+        _msort_natural (&d, 0, pbase, d.merge_buf, n, arg);
+      else
+        _msort_core (&d, 0, pbase, d.merge_buf, n, arg);
+    }
+
+  free (scratch);
+  return 0;
+}
+
+/* the unmerged part of one input to a k-way merge */
+struct _merge_k_cursor {
+	const char *cur;
+	const char *end;
+	size_t pos;		/* position of cur in the concatenated inputs */
+};
+
+/* a node of a loser tree: the input that lost the match there, its next
+ * element and, when def describes a key, that element's key. Replaying a
+ * match then needn't wait on the cursor or, unless the keys tie, on the
+ * element. An exhausted input's node has no element and loses to all. */
+struct _merge_k_node {
+	uint64_t key;
+	const char *elem;
+	int input;
+};
+
+/* non-zero if nodes carry keys: from def->prefix, else def->key_width */
+static __always_inline int _merge_k_keyed(const struct qsort_def *def) {
+	return def->prefix || def->key_width;
+}
+
+/* the node for input i whose next element is p, or NULL once it's exhausted */
+static __always_inline struct _merge_k_node
+_merge_k_load(const struct qsort_def *def, const char *p, int i, void *arg) {
+	struct _merge_k_node node = {UINT64_MAX, p, i};
+
+	if (_merge_k_keyed(def) && p)
+		node.key = def->prefix ? def->prefix(p, arg)
+				       : _quicksort_key_bits(def, p);
+	return node;
+}
+
+/* non-zero if node a goes before node b. Ties go to the lower numbered
+ * input, keeping the merge stable. Rather than branching on which that is,
+ * the later input's element is compared against the earlier's and the result
+ * flipped if a is the earlier. */
+static __always_inline int
+_merge_k_beats(const struct qsort_def *def, const struct _merge_k_node *a,
+	       const struct _merge_k_node *b, void *arg) {
+	const int a_first = a->input < b->input;
+	const char *late, *early;
+
+	if (_merge_k_keyed(def) && a->key != b->key)
+		return a->key < b->key;
+
+	/* exhausted inputs lose (their keys only tie with the largest) */
+	if (unlikely(!a->elem || !b->elem))
+		return a->elem != NULL;
+
+	/* a key_width key orders elements exactly as less does */
+	if (def->key_width && !def->prefix)
+		return a_first;
+
+	late  = a_first ? b->elem : a->elem;
+	early = a_first ? a->elem : b->elem;
+	return def->less(late, early, arg) ^ a_first;
+}
+
+/* replay the matches on the path from winner's input to the root of the loser
+ * tree tree[1..k-1], leaving the overall winner in tree[0] */
+static __always_inline void
+_merge_k_adjust(const struct qsort_def *def, struct _merge_k_node *tree, int k,
+		struct _merge_k_node winner, void *arg) {
+	int t;
+
+	for (t = (winner.input + k) / 2; t > 0; t /= 2) {
+		const struct _merge_k_node loser = tree[t];
+		const int swap = _merge_k_beats(def, &loser, &winner, arg);
+
+		tree[t] = swap ? winner : loser;
+		winner  = swap ? loser : winner;
+	}
+	tree[0] = winner;
+}
+
+/* build a loser tree over k non-empty inputs. Nodes start out as input -1,
+ * which beats any other, and each real input in turn displaces one. */
+static __always_inline void
+_merge_k_build(const struct qsort_def *def, const struct _merge_k_cursor *c,
+	       struct _merge_k_node *tree, int k, void *arg) {
+	int i, t;
+
+	for (i = 0; i < k; ++i)
+		tree[i].input = -1;
+
+	for (i = k; i--;) {
+		struct _merge_k_node winner = _merge_k_load(def, c[i].cur, i, arg);
+
+		for (t = (i + k) / 2; t > 0; t /= 2) {
+			const struct _merge_k_node loser = tree[t];
+
+			if (loser.input < 0 || (winner.input >= 0
+			    && _merge_k_beats(def, &loser, &winner, arg))) {
+				tree[t] = winner;
+				winner = loser;
+			}
+		}
+		tree[0] = winner;
+	}
+}
+
+/**
+ * merge_k_template - stable merge of k sorted arrays
+ * @def:     the template parameters
+ * @inputs:  the sorted arrays
+ * @lengths: number of elements in each
+ * @k:       number of arrays
+ * @out:     room for the sum of lengths elements, aligned like the inputs,
+ *           or size_t positions if def->merge_index is set
+ * @arg:     passed to def->less
+ *
+ * Merges through a loser tree, so each output element costs about log2(k)
+ * comparisons. If def->prefix or def->key_width gives a key, the tree holds
+ * each input's next key and only touches elements to break ties. Exhausted
+ * inputs stay in the tree, losing every match. Equal elements come out in
+ * input order. With def->merge_index,
+ * elements aren't copied; instead each is identified by its position in the
+ * concatenation of the inputs, e.g. the first element of inputs[1] is
+ * lengths[0].
+ *
+ * Returns zero on success, EINVAL if k doesn't fit in an int, or ENOMEM.
+ */
+static __always_inline __flatten int
+merge_k_template (const struct qsort_def *def, const void *const inputs[],
+                  const size_t lengths[], size_t k, void *out, void *arg)
+{
+  const size_t size = def->size;
+  struct _merge_k_cursor *c;
+  size_t *out_index = out;
+  char *out_elem = out;
+  size_t total = 0, i;
+  struct _merge_k_node *tree;
+  int live = 0;
+
+  if (k > INT_MAX)
+    return EINVAL;
+
+  c = malloc (k * (sizeof (*c) + sizeof (*tree)));
+  if (!c)
+    return ENOMEM;
+  tree = (struct _merge_k_node *) (c + k);
+
+  /* empty inputs are left out from the start */
+  for (i = 0; i < k; ++i)
+    {
+      if (lengths[i])
+        {
+          c[live].cur = inputs[i];
+          c[live].end = c[live].cur + lengths[i] * size;
+          c[live].pos = total;
+          ++live;
+        }
+      total += lengths[i];
+    }
+
+  if (live)
+    _merge_k_build (def, c, tree, live, arg);
 
-      d.size = sizeof(void *);
-      d.align = _Alignof(void *);
+  for (i = total; i; --i)
+    {
+      const int w = tree[0].input;
 
-      if (!d.index)
+      if (def->merge_index)
+        *out_index++ = c[w].pos++;
+      else
         {
-          index_on_heap = 1;
-          d.index = malloc(sizeof(void *) * n);
-          if (!d.index)
-            {
-              ret = ENOMEM;
-              goto exit_free_elem_buf;
-            }
+          _quicksort_copy (def, out_elem, c[w].cur);
+          out_elem += size;
         }
 
-      assert(!((uintptr_t)d.index & (d.align - 1)));
+      c[w].cur += size;
+      _merge_k_adjust (def, tree, live,
+                       _merge_k_load (def, likely (c[w].cur != c[w].end)
+                                           ? c[w].cur : NULL, w, arg), arg);
+    }
 
-      for (i = n; i--;)
-        d.index[i] = base_ptr + i * def->size;
-      base_ptr = (char *) d.index;
+  free (c);
+  return 0;
+}
 
-//  printf("pbase = %p, base_ptr = %p, d.elem_buf = %p, d.index = %p\n", pbase, base_ptr, d.elem_buf, d.index);
-    }
+/*
+ * _qsort_batch_one -- sort one group for the batch templates
+ * d:           the template parameters, with elem_buf set for direct sorts
+ * ctx:         scratch space for groups that need qsort_ctx_template
+ */
+static __always_inline int
+_qsort_batch_one(const struct qsort_def *d, struct qsort_ctx *ctx, char *base,
+		 size_t n, void *arg) {
+	if (n <= 1)
+		return 0;
+
+	if (_quicksort_network_ok(d) && n <= _QSORT_NETWORK_MAX) {
+		_quicksort_network(d, base, n);
+		return 0;
+	}
 
-  /* now that we're certain about d.size... */
-  max_thresh = MAX_THRESH * d.size;
+	if (d->size <= _QSORT_IND_THRESH && n <= _QSORT_BATCH_INSERTION) {
+		_msort_insertion(d, _QSORT_DIRECT, base, n, arg);
+		return 0;
+	}
 
+	return qsort_ctx_template(d, ctx, base, n, arg);
+}
 
-  /* These locals should still be compile-time constants */
-  assert_const(elem_buf_on_heap);
-  assert_const(index_on_heap);
-  assert_const(indirect);
-  assert_const(max_thresh);
+/**
+ * qsort_batch_template - sort many small, equally sized groups of elements
+ * @def:         the template parameters
+ * @pbase:       the first group; the rest follow it contiguously
+ * @group_len:   elements per group
+ * @group_count: number of groups
+ * @arg:         passed to def->less
+ *
+ * Each group is sorted separately. The setup qsort_template would do for
+ * every group (element buffer, index allocation, thresholds) is done once.
+ * Groups that fit a sorting network (see qsort_def::network) use one and,
+ * if group_len is a compile-time constant and the keys are integers,
+ * _QSORT_BATCH_LANES groups at a time are transposed into vectors so that
+ * each comparator of the network sorts a whole slice of them at once.
+ * Small groups of other element types are insertion sorted. Anything else
+ * goes through qsort_ctx_template with a shared context.
+ *
+ * Returns zero on success, ENOMEM or EINVAL.
+ */
+static __always_inline __flatten int
+qsort_batch_template (const struct qsort_def *def, void *const pbase,
+                      size_t group_len, size_t group_count, void *arg)
+{
+  struct qsort_def d = *def;
+  struct qsort_ctx ctx = QSORT_CTX_INIT;
+  char elem_buf[_QSORT_IND_THRESH] __aligned(_QSORT_ALIGN_MAX);
+  const size_t group_bytes = group_len * def->size;
+  char *p = pbase;
+  size_t g = 0;
+  int ret = 0;
+
+  if (group_len <= 1)
+    return 0;
 
-  if (n > MAX_THRESH)
+  if (_quicksort_network_ok (def) && group_len <= _QSORT_NETWORK_MAX)
     {
-      char *lo = base_ptr;
-      char *hi = &lo[d.size * (n - 1)];
-      stack_node stack[STACK_SIZE];
-      stack_node *top = stack;
+      if (__builtin_constant_p (group_len)
+          && def->key_type != QSORT_KEY_FLOAT)
+        for (; g + _QSORT_BATCH_LANES <= group_count; g += _QSORT_BATCH_LANES)
+          _quicksort_batch_network (def, p + g * group_bytes, group_len);
 
-      PUSH (NULL, NULL);
+      for (; g < group_count; ++g)
+        _quicksort_network (def, p + g * group_bytes, group_len);
 
-      while (STACK_NOT_EMPTY)
-        {
-          char *left_ptr;
-          char *right_ptr;
-
-          /* Select median value from among LO, MID, and HI. Rearrange
-             LO and HI so the three values are sorted. This lowers the
-             probability of picking a pathological pivot value and
-             skips a comparison for both the LEFT_PTR and RIGHT_PTR in
-             the while loops. */
+      return 0;
+    }
 
-          char *mid = lo + d.size * ((hi - lo) / d.size >> 1);
+  if (!d.elem_buf && def->size <= _QSORT_IND_THRESH)
+    d.elem_buf = elem_buf;
 
-          if (_quicksort_less (&d, indirect, (void *) mid, (void *) lo, arg))
-            _quicksort_swap (&d, mid, lo);
-          if (_quicksort_less (&d, indirect, (void *) hi, (void *) mid, arg))
-            _quicksort_swap (&d, mid, hi);
-          else
-            goto jump_over;
-          if (_quicksort_less (&d, indirect, (void *) mid, (void *) lo, arg))
-            _quicksort_swap (&d, mid, lo);
-        jump_over:
-          ;
-
-          left_ptr  = lo + d.size;
-          right_ptr = hi - d.size;
-
-          /* Here's the famous ``collapse the walls'' section of quicksort.
-             Gotta like those tight inner loops!  They are the main reason
-             that this algorithm runs much faster than others. */
-          do
-            {
-              while (_quicksort_less (&d, indirect, (void *) left_ptr, (void *) mid, arg))
-                left_ptr += d.size;
+  for (; g < group_count && !ret; ++g)
+    ret = _qsort_batch_one (&d, &ctx, p + g * group_bytes, group_len, arg);
 
-              while (_quicksort_less (&d, indirect, (void *) mid, (void *) right_ptr, arg))
-                right_ptr -= d.size;
+  qsort_ctx_destroy (&ctx);
+  return ret;
+}
 
-              if (left_ptr < right_ptr)
-                {
-                  _quicksort_swap (&d, left_ptr, right_ptr);
-                  if (mid == left_ptr)
-                    mid = right_ptr;
-                  else if (mid == right_ptr)
-                    mid = left_ptr;
-                  left_ptr += d.size;
-                  right_ptr -= d.size;
-                }
-              else if (left_ptr == right_ptr)
-                {
-                  left_ptr += d.size;
-                  right_ptr -= d.size;
-                  break;
-                }
-            }
-          while (left_ptr <= right_ptr);
+/**
+ * qsort_segments_template - sort many variable length runs of an array
+ * @def:           the template parameters
+ * @pbase:         the array
+ * @offsets:       segment_count + 1 element offsets; segment i is the
+ *                 elements offsets[i] to offsets[i + 1] - 1
+ * @segment_count: number of segments
+ * @arg:           passed to def->less
+ *
+ * Each segment is sorted separately, sharing setup as qsort_batch_template
+ * does (but without sorting across lanes, since segments differ in length).
+ *
+ * Returns zero on success, ENOMEM or EINVAL.
+ */
+static __always_inline __flatten int
+qsort_segments_template (const struct qsort_def *def, void *const pbase,
+                         const size_t *offsets, size_t segment_count,
+                         void *arg)
+{
+  struct qsort_def d = *def;
+  struct qsort_ctx ctx = QSORT_CTX_INIT;
+  char elem_buf[_QSORT_IND_THRESH] __aligned(_QSORT_ALIGN_MAX);
+  char *p = pbase;
+  size_t i;
+  int ret = 0;
 
-          /* Set up pointers for next iteration.  First determine whether
-             left and right partitions are below the threshold size.  If so,
-             ignore one or both.  Otherwise, push the larger partition's
-             bounds on the stack and continue sorting the smaller one. */
+  if (!d.elem_buf && def->size <= _QSORT_IND_THRESH)
+    d.elem_buf = elem_buf;
 
-          if ((size_t) (right_ptr - lo) <= max_thresh)
-            {
-              if ((size_t) (hi - left_ptr) <= max_thresh)
-                /* Ignore both small partitions. */
-                POP (lo, hi);
-              else
-                /* Ignore small left partition. */
-                lo = left_ptr;
-            }
-          else if ((size_t) (hi - left_ptr) <= max_thresh)
-            /* Ignore small right partition. */
-            hi = right_ptr;
-          else if ((right_ptr - lo) > (hi - left_ptr))
-            {
-              /* Push larger left partition indices. */
-              PUSH (lo, right_ptr);
-              lo = left_ptr;
-            }
-          else
-            {
-              /* Push larger right partition indices. */
-              PUSH (left_ptr, hi);
-              hi = right_ptr;
-            }
-        }
+  for (i = 0; i < segment_count && !ret; ++i)
+    {
+      assert (offsets[i] <= offsets[i + 1]);
+      ret = _qsort_batch_one (&d, &ctx, p + offsets[i] * def->size,
+                              offsets[i + 1] - offsets[i], arg);
     }
 
-  /* Once the BASE_PTR array is partially sorted by quicksort the rest
-     is completely sorted using insertion sort, since this is efficient
-     for partitions below MAX_THRESH size. BASE_PTR points to the beginning
-     of the array to sort, and END_PTR points at the very last element in
-     the array (*not* one beyond it!). */
+  qsort_ctx_destroy (&ctx);
+  return ret;
+}
 
+/*
+ * _quicksort_select_mom -- deterministic (BFPRT) selection
+ * def:         the template parameters
+ * indirect:    non-zero if elements are pointers to the real data
+ * lo:          first element
+ * n:           number of elements
+ * k:           index of the element to select
+ *
+ * The pivot is the median of the medians of groups of five, which always
+ * leaves at least 3/10 of the range on each side and so guarantees linear
+ * time. Finding that median is itself a selection, so rather than recursing
+ * (always-inline templates can't) pending selections are kept on an explicit
+ * stack: each frame first pushes the selection of its medians and then, once
+ * that has returned a pivot, partitions around it and narrows its range.
+ * Each frame's range is a fifth of its parent's, so 32 frames are plenty.
+ *
+ * Returns a pointer to the k-th element, with smaller elements before it
+ * and larger ones after.
+ */
+static __always_inline char *
+_quicksort_select_mom(const struct qsort_def *def, int indirect, char *lo,
+		      size_t n, size_t k, void *arg) {
+	const size_t size = def->size;
+	struct {
+		char *lo;
+		size_t n;
+		size_t k;
+		int have_pivot;
+	} stack[32], *f;
+	size_t top = 0;
+	char *ret = lo;
+
+	stack[top].lo = lo;
+	stack[top].n = n;
+	stack[top].k = k;
+	stack[top++].have_pivot = 0;
+
+	while (top) {
+		f = &stack[top - 1];
+
+		if (!f->have_pivot) {
+			size_t i, groups;
+
+			if (f->n <= 5) {
+				_msort_insertion(def, indirect, f->lo, f->n, arg);
+				ret = f->lo + f->k * size;
+				--top;
+				continue;
+			}
+
+			/* gather the medians of each group of 5 at the front */
+			groups = f->n / 5;
+			for (i = 0; i < groups; ++i) {
+				char *g = f->lo + i * 5 * size;
+
+				_msort_insertion(def, indirect, g, 5, arg);
+				_quicksort_swap(def, f->lo + i * size, g + 2 * size);
+			}
+
+			assert(top < sizeof(stack) / sizeof(*stack));
+			f->have_pivot = 1;
+			stack[top].lo = f->lo;
+			stack[top].n = groups;
+			stack[top].k = groups / 2;
+			stack[top++].have_pivot = 0;
+		} else {
+			/* ret is the median of medians */
+			char *hi = f->lo + (f->n - 1) * size;
+			char *target = f->lo + f->k * size;
+			char *lt_end, *gt_start;
+
+			_quicksort_swap(def, f->lo, ret);
+			_quicksort_partition_three_way(def, indirect, f->lo, hi,
+						       &lt_end, &gt_start, arg);
+
+			f->have_pivot = 0;
+			if (target <= lt_end) {
+				f->n = (size_t)(lt_end - f->lo) / size + 1;
+			} else if (target >= gt_start) {
+				f->k -= (size_t)(gt_start - f->lo) / size;
+				f->n = (size_t)(hi - gt_start) / size + 1;
+				f->lo = gt_start;
+			} else {
+				ret = target;
+				--top;
+			}
+		}
+	}
 
-  /* if element size is a power of two, indexed addressing will be more
-   * efficient in most cases */
-  if (d.size <= _QSORT_ARCH_MAX_INDEX_MULT || !(d.size & (d.size - 1)))
-    {
-      const size_t thresh = min (n, MAX_THRESH + 1);
-      size_t left, right;
-      void *smallest;
+	return ret;
+}
 
-      /* Find smallest element in first threshold and place it at the
-          array's beginning.  This is the smallest array element,
-          and the operation speeds up insertion sort's inner loop. */
+/*
+ * _quicksort_select -- introselect
+ * def:         the template parameters
+ * indirect:    non-zero if elements are pointers to the real data
+ * base:        the array
+ * n:           number of elements
+ * k:           index of the element to select
+ *
+ * Quickselect with median-of-three pivots and three-way partitioning (so
+ * runs of equal keys end the search early rather than slowing it down).
+ * After 2 * log2(n) partitions without finishing, the rest of the range is
+ * handed to _quicksort_select_mom.
+ */
+static __always_inline void
+_quicksort_select(const struct qsort_def *def, int indirect, char *base,
+		  size_t n, size_t k, void *arg) {
+	const size_t size = def->size;
+	char *lo = base;
+	char *hi = base + (n - 1) * size;
+	char *const target = base + k * size;
+	size_t budget = 2 * (sizeof(size_t) * CHAR_BIT - 1 - __builtin_clzl(n));
+
+	while ((size_t)(hi - lo) >= _QSORT_SELECT_THRESH * size) {
+		char *mid = lo + size * ((size_t)(hi - lo) / size >> 1);
+		char *lt_end, *gt_start;
+
+		if (!budget--) {
+			_quicksort_select_mom(def, indirect, lo,
+					      (size_t)(hi - lo) / size + 1,
+					      (size_t)(target - lo) / size, arg);
+			return;
+		}
+
+		if (_quicksort_less(def, indirect, mid, lo, arg))
+			_quicksort_swap(def, mid, lo);
+		if (_quicksort_less(def, indirect, hi, mid, arg)) {
+			_quicksort_swap(def, mid, hi);
+			if (_quicksort_less(def, indirect, mid, lo, arg))
+				_quicksort_swap(def, mid, lo);
+		}
+
+		_quicksort_swap(def, lo, mid);
+		_quicksort_partition_three_way(def, indirect, lo, hi, &lt_end,
+					       &gt_start, arg);
+
+		if (target <= lt_end)
+			hi = lt_end;
+		else if (target >= gt_start)
+			lo = gt_start;
+		else
+			return;
+	}
 
-      for (smallest = base_ptr, right = 1; right < thresh; ++right)
-        {
-          char *p = base_ptr + right * d.size;
+	_msort_insertion(def, indirect, lo, (size_t)(hi - lo) / size + 1, arg);
+}
 
-          if (_quicksort_less (&d, indirect, p, smallest, arg))
-            smallest = p;
-        }
+/**
+ * select_template - partially order an array around its k-th element
+ *                   (nth_element)
+ * @def:   the template parameters
+ * @pbase: the array
+ * @n:     number of elements
+ * @k:     index of the element to select (must be less than n)
+ * @arg:   passed to def->less
+ *
+ * On return, the element at k is the one that would be there were the array
+ * sorted, no element before it is greater and no element after it is less.
+ * Elements larger than _QSORT_IND_THRESH are selected through an index of
+ * pointers (def->index if supplied) and then permuted into place.
+ *
+ * Returns zero on success or ENOMEM.
+ */
+static __always_inline __flatten int
+select_template (const struct qsort_def *def, void *const pbase, size_t n,
+                 size_t k, void *arg)
+{
+  struct qsort_def d = *def;
+  const int indirect = def->size > _QSORT_IND_THRESH; /* ct const */
+  /* room for one (direct) element or pointer, for swapping */
+  char elem_buf[_QSORT_IND_THRESH] __aligned(_QSORT_ALIGN_MAX);
+  char *scratch = NULL;
 
-      if (smallest != base_ptr)
-        _quicksort_swap (&d, smallest, base_ptr);
+  assert_const(indirect);
+  assert (k < n || !n);
 
-      for (right = 2; right < n; ++right)
-        {
-          left = right - 1;
-          while (_quicksort_less (&d, indirect, &base_ptr[right * d.size], &base_ptr[left * d.size], arg))
-            {
-              assert(left);
-              --left;
-            }
+  if (n <= 1)
+    return 0;
 
-          ++left;
-          if (left != right)
-            _quicksort_ror(&d, &base_ptr[left * d.size], &base_ptr[right * d.size]);
+  if (indirect)
+    {
+      struct qsort_def id = d;
+      const size_t elem_bytes = d.elem_buf ? 0 : (def->size + _Alignof (void *) - 1)
+                                                 & ~(_Alignof (void *) - 1);
+      const size_t index_bytes = d.index ? 0 : n * sizeof (void *);
+      size_t align = min (def->align, _QSORT_ALIGN_MAX);
+      size_t i;
+      char *p;
+
+      if (align < _Alignof (void *))
+        align = _Alignof (void *);
+
+      if (elem_bytes + index_bytes)
+        {
+          scratch = aligned_alloc (align, (elem_bytes + index_bytes + align - 1)
+                                          & ~(align - 1));
+          if (!scratch)
+            return ENOMEM;
+          if (elem_bytes)
+            d.elem_buf = scratch;
+          if (index_bytes)
+            d.index = (void **) (scratch + elem_bytes);
         }
+
+      for (i = 0, p = pbase; i < n; ++i, p += def->size)
+        d.index[i] = p;
+
+      id.size     = sizeof (void *);
+      id.align    = _Alignof (void *);
+      id.elem_buf = elem_buf;
+      _quicksort_select (&id, 1, (char *) d.index, n, k, arg);
+      _quicksort_permute (def, pbase, d.index, n, d.elem_buf);
     }
   else
     {
-      /* if not a power of two, use ptr arithmetic */
-      char *const end_ptr = &base_ptr[d.size * (n - 1)];
-      char *tmp_ptr = base_ptr;
-      char *thresh = min(end_ptr, base_ptr + max_thresh);
-      register char *run_ptr;
+      d.elem_buf = elem_buf;
+      _quicksort_select (&d, 0, pbase, n, k, arg);
+    }
 
-      /* Find smallest element in first threshold and place it at the
-         array's beginning.  This is the smallest array element,
-         and the operation speeds up insertion sort's inner loop. */
+  free (scratch);
+  return 0;
+}
 
-      for (run_ptr = tmp_ptr + d.size; run_ptr <= thresh; run_ptr += d.size)
-        if (_quicksort_less (&d, indirect, (void *) run_ptr, (void *) tmp_ptr, arg))
-          tmp_ptr = run_ptr;
+/**
+ * partial_sort_template - sort just the k smallest elements of an array
+ * @def:   the template parameters
+ * @pbase: the array
+ * @n:     number of elements
+ * @k:     number of elements wanted at the front, in order
+ * @arg:   passed to def->less
+ *
+ * The first k elements end up sorted and no greater than any of the rest,
+ * which are left in no particular order. This is select_template followed
+ * by qsort_template on the first k elements.
+ *
+ * Returns zero on success or ENOMEM.
+ */
+static __always_inline __flatten int
+partial_sort_template (const struct qsort_def *def, void *const pbase,
+                       size_t n, size_t k, void *arg)
+{
+  int ret;
 
-      if (tmp_ptr != base_ptr)
-        _quicksort_swap (&d, tmp_ptr, base_ptr);
+  if (k >= n)
+    return qsort_template (def, pbase, n, arg);
 
-      /* Insertion sort, running from left-hand-side up to right-hand-side.  */
+  if (!k)
+    return 0;
 
-      run_ptr = base_ptr + d.size;
-      while ((run_ptr += d.size) <= end_ptr)
-        {
-          tmp_ptr = run_ptr - d.size;
-          while (_quicksort_less (&d, indirect, (void *) run_ptr, (void *) tmp_ptr, arg))
-            tmp_ptr -= d.size;
+  ret = select_template (def, pbase, n, k, arg);
+  if (ret)
+    return ret;
 
-          tmp_ptr += d.size;
-          if (tmp_ptr != run_ptr)
-            _quicksort_ror(&d, tmp_ptr, run_ptr);
-        }
-    }
+  return qsort_template (def, pbase, k, arg);
+}
 
+/* An extracted key and the element it came from, used when radix sorting
+ * elements too large to move around on every pass. */
+struct _radix_pair {
+	uint64_t key;
+	void *elem;
+};
 
-  /* if we used indirect sorting, now we have to re-arrange the array. */
-  if (indirect)
+static __always_inline int
+_radix_pair_less(const void *a, const void *b, void *context) {
+	return ((const struct _radix_pair *)a)->key
+	     < ((const struct _radix_pair *)b)->key;
+}
+
+/*
+ * _radix_scatter -- distribute src into dst by one byte of the key
+ * counts:      histogram of that byte over the n elements of src
+ * shift:       bit position of the byte within the key
+ */
+static __always_inline void
+_radix_scatter(const struct qsort_def *def, char *dst, const char *src,
+	       size_t n, const size_t counts[256], unsigned shift) {
+	const size_t size = def->size;
+	char *pos[256];
+	char *p = dst;
+	size_t i;
+
+	for (i = 0; i < 256; ++i) {
+		pos[i] = p;
+		p += counts[i] * size;
+	}
+
+	for (i = 0; i < n; ++i, src += size) {
+		unsigned byte = (_quicksort_key_bits(def, src) >> shift) & 0xff;
+
+		_quicksort_copy(def, pos[byte], src);
+		pos[byte] += size;
+	}
+}
+
+/*
+ * _radix_sort_core -- sort n elements of def->size bytes by their key
+ * base:        the array
+ * buf:         scratch space for n elements
+ *
+ * One MSD pass on the most significant byte that isn't the same for every key
+ * splits the input into buckets in buf. Small buckets are copied back and
+ * handed to qsort_template, the rest get LSD passes over the remaining bytes,
+ * ping-ponging between buf and base and skipping bytes that are constant
+ * within the bucket.
+ */
+static __always_inline void
+_radix_sort_core(const struct qsort_def *def, char *base, char *buf,
+		 size_t n, void *arg) {
+	struct qsort_def d = *def;
+	const size_t size = def->size;
+	const size_t width = def->key_width;
+	char elem_buf[_QSORT_IND_THRESH] __aligned(_QSORT_ALIGN_MAX);
+	size_t counts[sizeof(uint64_t)][256];
+	size_t bucket_counts[256];
+	size_t i, b, offset;
+	unsigned msd;
+	const char *p;
+
+	BUILD_BUG_ON_MSG(size > _QSORT_IND_THRESH, "elements too large to radix sort directly");
+
+	/* one shared element buffer for every qsort_template call below */
+	d.elem_buf = elem_buf;
+
+	/* histogram every byte of the key in one pass */
+	memset(counts, 0, sizeof(counts));
+	for (i = 0, p = base; i < n; ++i, p += size) {
+		uint64_t k = _quicksort_key_bits(def, p);
+
+		for (b = 0; b < width; ++b)
+			++counts[b][(k >> (b * CHAR_BIT)) & 0xff];
+	}
+
+	/* find the most significant byte that differs between keys; bytes
+	 * that are the same everywhere need no passes at all */
+	for (msd = width; msd--;) {
+		const uint64_t k = _quicksort_key_bits(def, base);
+
+		if (counts[msd][(k >> (msd * CHAR_BIT)) & 0xff] != n)
+			break;
+	}
+
+	if (msd == (unsigned)-1)
+		return;		/* every key is equal */
+
+	_radix_scatter(def, buf, base, n, counts[msd], msd * CHAR_BIT);
+
+	for (i = 0, offset = 0; i < 256; offset += counts[msd][i++] * size) {
+		const size_t count = counts[msd][i];
+		char *src = buf + offset;
+		char *dst = base + offset;
+
+		if (count <= _QSORT_RADIX_THRESH || !msd) {
+			memcpy(dst, src, count * size);
+			if (msd && count > 1)
+				qsort_template(&d, dst, count, arg);
+			continue;
+		}
+
+		for (b = 0; b < msd; ++b) {
+			const unsigned shift = b * CHAR_BIT;
+			const char *q;
+			size_t j;
+			char *tmp;
+
+			memset(bucket_counts, 0, sizeof(bucket_counts));
+			for (j = 0, q = src; j < count; ++j, q += size)
+				++bucket_counts[(_quicksort_key_bits(def, q) >> shift) & 0xff];
+
+			if (bucket_counts[(_quicksort_key_bits(def, src) >> shift) & 0xff] == count)
+				continue;	/* nothing to do for this byte */
+
+			_radix_scatter(def, dst, src, count, bucket_counts, shift);
+			tmp = src;
+			src = dst;
+			dst = tmp;
+		}
+
+		if (src != base + offset)
+			memcpy(base + offset, src, count * size);
+	}
+}
+
+/**
+ * radix_sort_template - sort an array by the key described in def
+ * @def:   the template parameters, including key_offset, key_width and
+ *         key_type; less is still needed for small buckets
+ * @pbase: the array
+ * @n:     number of elements
+ * @arg:   passed to def->less
+ *
+ * Elements larger than _QSORT_IND_THRESH are not moved on each pass; instead
+ * their keys are extracted once into (key, pointer) pairs, the pairs are
+ * sorted, and the array is permuted into place at the end.
+ *
+ * Returns zero on success or ENOMEM if scratch space could not be allocated.
+ */
+static __always_inline __flatten int
+radix_sort_template (const struct qsort_def *def, void *const pbase,
+                     size_t n, void *arg)
+{
+  const int indirect = def->size > _QSORT_IND_THRESH; /* ct const */
+  size_t align = min (def->align, _QSORT_ALIGN_MAX);
+  size_t bytes;
+  char *scratch;
+
+  assert_const(def->key_width);
+  assert_const(indirect);
+  BUILD_BUG_ON_MSG(!def->key_width, "radix_sort_template requires a key");
+
+  if (n <= _QSORT_RADIX_THRESH)
+    return qsort_template (def, pbase, n, arg);
+
+  if (!indirect)
     {
-      size_t i;		// current element (indecies)
-      char *ip;		// pointer to the current element
-      char *kp;
+      bytes = (n * def->size + align - 1) & ~(align - 1);
+      scratch = aligned_alloc (align, bytes);
+      if (!scratch)
+        return ENOMEM;
 
-      for (i = 0, ip = (char *)pbase; i < n; ++i, ip += def->size)
-        {
-          if ((kp = d.index[i]) != ip)
-            {
-              size_t j = i;
-              char *jp = ip;
-              _quicksort_copy (def, d.elem_buf, ip);
+      _radix_sort_core (def, pbase, scratch, n, arg);
+    }
+  else
+    {
+      const struct qsort_def pair_def = {
+        .size      = sizeof (struct _radix_pair),
+        .align     = _Alignof (struct _radix_pair),
+        .less      = _radix_pair_less,
+        .key_offset = offsetof (struct _radix_pair, key),
+        .key_width = sizeof (uint64_t),
+      };
+      /* the element buffer is first so that it keeps the array's alignment */
+      const size_t elem_bytes = (def->size + _Alignof (struct _radix_pair) - 1)
+                                & ~(_Alignof (struct _radix_pair) - 1);
+      struct _radix_pair *pairs;
+      void **index;
+      char *p;
+      size_t i;
 
-              do
-                {
-                  size_t k = (kp - (char *)pbase) / def->size;
-                  d.index[j] = jp;
-                  _quicksort_copy (def, jp, kp);
-                  j = k;
-                  jp = kp;
-                  kp = d.index[k];
-                }
-              while (kp != ip);
+      if (align < _Alignof (struct _radix_pair))
+        align = _Alignof (struct _radix_pair);
 
-              d.index[j] = jp;
-              _quicksort_copy (def, jp, d.elem_buf);
-            }
+      bytes = elem_bytes + 2 * n * sizeof (*pairs);
+      bytes = (bytes + align - 1) & ~(align - 1);
+      scratch = aligned_alloc (align, bytes);
+      if (!scratch)
+        return ENOMEM;
+
+      pairs = (struct _radix_pair *) (scratch + elem_bytes);
+      for (i = 0, p = pbase; i < n; ++i, p += def->size)
+        {
+          pairs[i].key  = _quicksort_key_bits (def, p);
+          pairs[i].elem = p;
         }
-    }
 
-  if (index_on_heap)
-    free (d.index);
+      _radix_sort_core (&pair_def, (char *) pairs, (char *) (pairs + n), n,
+                        arg);
 
-exit_free_elem_buf:
-  if (elem_buf_on_heap)
-    free (d.elem_buf);
+      /* Compact the pointers into an index in place. Entry i overwrites
+         half of pair i / 2, which has already been read. */
+      index = (void **) pairs;
+      for (i = 0; i < n; ++i)
+        index[i] = pairs[i].elem;
 
-  return ret;
+      _quicksort_permute (def, pbase, index, n, scratch);
+    }
+
+  free (scratch);
+  return 0;
 }
 
 #endif /* _QSORT_H_ */
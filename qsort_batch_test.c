@@ -0,0 +1,223 @@
+/*
+ * qsort_batch_test - throughput benchmark for qsort_batch_template
+ * Copyright (C) 2014 Daniel Santos <daniel.santos@pobox.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/* usage: qsort_batch_test [group_count [repeat_count]]
+ *
+ * Sorts group_count groups of GROUP_LEN elements, one qsort_template call per
+ * group and then in batches, and prints the throughput of each as CSV. */
+
+#define  _ISOC11_SOURCE
+#define _GNU_SOURCE
+
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <error.h>
+#include <assert.h>
+
+#include "qsort.h"
+#include "utils.h"
+
+#ifndef ELEM_SIZE
+# define ELEM_SIZE 4
+#endif
+
+#ifndef ALIGN_SIZE
+# define ALIGN_SIZE 4
+#endif
+
+#ifndef TEST_COUNT
+# define TEST_COUNT 5
+#endif
+
+#include "test_elem.h"
+
+#ifndef GROUP_LEN
+# define GROUP_LEN 4
+#endif
+
+#ifndef GROUP_COUNT
+# define GROUP_COUNT (1024 * 1024)
+#endif
+
+/* for the reference sort, with libc's qsort_r */
+static int my_cmp(const void *a, const void *b, void *context) {
+	return my_less(b, a, context) - my_less(a, b, context);
+}
+
+static const struct qsort_def my_def = {
+	.size = ELEM_SIZE,
+	.align = ALIGN_SIZE,
+	.less = my_less,
+};
+
+static const struct qsort_def my_network_def = {
+	.size = ELEM_SIZE,
+	.align = ALIGN_SIZE,
+	.less = my_less,
+	.key_width = MY_KEY_WIDTH,
+	.key_type = QSORT_KEY_UNSIGNED,
+	.network = 1,
+};
+
+typedef int (*batch_func_t)(void *p, size_t group_len, size_t group_count);
+
+/* one call per group, as a caller without the batch API would do it (not
+ * inlined into the loop, where qsort_template's alloca would pile up) */
+static __noinline __flatten int one_qsort(void *p, size_t n) {
+	return qsort_template(&my_def, p, n, NULL);
+}
+
+static __noinline __flatten int one_network(void *p, size_t n) {
+	return qsort_template(&my_network_def, p, n, NULL);
+}
+
+static __noinline int each_qsort(void *p, size_t group_len, size_t group_count) {
+	size_t i;
+
+	for (i = 0; i < group_count; ++i) {
+		int ret = one_qsort((char *)p + i * group_len * ELEM_SIZE, group_len);
+
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static __noinline int each_network(void *p, size_t group_len, size_t group_count) {
+	size_t i;
+
+	for (i = 0; i < group_count; ++i) {
+		int ret = one_network((char *)p + i * group_len * ELEM_SIZE, group_len);
+
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static __noinline __flatten int batch(void *p, size_t group_len, size_t group_count) {
+	return qsort_batch_template(&my_def, p, group_len, group_count, NULL);
+}
+
+static __noinline __flatten int batch_network(void *p, size_t group_len, size_t group_count) {
+	return qsort_batch_template(&my_network_def, p, group_len, group_count, NULL);
+}
+
+/* group_len is a compile-time constant here, so groups are sorted across
+ * vector lanes */
+static __noinline __flatten int batch_network_ct(void *p, size_t group_len, size_t group_count) {
+	return qsort_batch_template(&my_network_def, p, GROUP_LEN, group_count, NULL);
+}
+
+static size_t *offsets;
+
+static __noinline __flatten int segments(void *p, size_t group_len, size_t group_count) {
+	return qsort_segments_template(&my_network_def, p, offsets, group_count, NULL);
+}
+
+static const struct {
+	const char *desc;
+	batch_func_t fn;
+} batch_funcs[] = {
+	{"qsort_template each", each_qsort},
+	{"qsort_template each (network)", each_network},
+	{"qsort_batch_template", batch},
+	{"qsort_batch_template (network)", batch_network},
+	{"qsort_batch_template (network, ct len)", batch_network_ct},
+	{"qsort_segments_template (network)", segments},
+};
+
+/* sort each group of ref, a copy of the input, with libc's qsort_r and
+ * compare it to p */
+static void check_sorted(const char *p, char *ref, size_t group_count,
+			 const char *desc) {
+	const size_t group_size = GROUP_LEN * ELEM_SIZE;
+	size_t g, i;
+
+	for (g = 0; g < group_count; ++g, p += group_size, ref += group_size) {
+		qsort_r(ref, GROUP_LEN, ELEM_SIZE, my_cmp, NULL);
+		if (!memcmp(p, ref, group_size))
+			continue;
+
+		for (i = 0; i < GROUP_LEN; ++i)
+			if (memcmp(p + i * ELEM_SIZE, ref + i * ELEM_SIZE, ELEM_SIZE))
+				break;
+		fatal_error("%s: group %lu differs from qsort_r at %lu", desc, g, i);
+	}
+}
+
+int main(int argc, char **argv) {
+	size_t group_count = argc > 1 ? strtoul(argv[1], NULL, 0) : GROUP_COUNT;
+	unsigned test_count = argc > 2 ? strtoul(argv[2], NULL, 0) : TEST_COUNT;
+	size_t n = group_count * GROUP_LEN;
+	size_t bytes = n * ELEM_SIZE;
+	size_t i, j;
+	void *arr, *ref;
+
+	arr = aligned_alloc(ALIGN_SIZE, bytes);
+	ref = aligned_alloc(ALIGN_SIZE, bytes);
+	offsets = malloc((group_count + 1) * sizeof(*offsets));
+	if (unlikely(!arr || !ref || !offsets)) {
+		errno = ENOMEM;
+		fatal_error("malloc %lu bytes\n", bytes);
+	}
+
+	for (i = 0; i <= group_count; ++i)
+		offsets[i] = i * GROUP_LEN;
+
+	printf("group_len = %lu, group_count = %lu, elem_size = %lu, min_align = %lu, repeat_count = %u\n",
+	       (size_t)GROUP_LEN, group_count, (size_t)ELEM_SIZE, (size_t)ALIGN_SIZE, test_count);
+	printf("variant, time, groups/sec\n");
+
+	for (j = 0; j < sizeof(batch_funcs) / sizeof(*batch_funcs); ++j) {
+		struct timespec total = {0, 0};
+		double secs;
+
+		for (i = 0; i < test_count; ++i) {
+			struct timespec start, end;
+			int ret;
+
+			randomize(arr, n, ELEM_SIZE, i);
+			memcpy(ref, arr, bytes);
+			timespec_set(&start);
+			ret = batch_funcs[j].fn(arr, GROUP_LEN, group_count);
+			timespec_set(&end);
+			total = timespec_add(total, timespec_subtract(end, start));
+
+			if (ret)
+				fatal_error("%s returned %d\n", batch_funcs[j].desc, ret);
+			check_sorted(arr, ref, group_count, batch_funcs[j].desc);
+		}
+
+		secs = total.tv_sec + total.tv_nsec / 1000000000.;
+		printf("%s, %.6f, %.0f\n", batch_funcs[j].desc, secs / test_count,
+		       secs > 0. ? group_count * test_count / secs : 0.);
+	}
+
+	free(offsets);
+	free(ref);
+	free(arr);
+	return 0;
+}
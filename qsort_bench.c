@@ -0,0 +1,365 @@
+/*
+ * qsort_bench - qsort_template benchmark over a matrix of element sizes and
+ *		 alignments, all built into one binary
+ * Copyright (C) 2014 Daniel Santos <daniel.santos@pobox.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/* usage: qsort_bench [-s sizes] [-a aligns] [-t total_sizes] [-r repeat_count]
+ *		      [-f csv|json] [-l]
+ *
+ * Runs the same comparison as qsort_test (_quicksort, qsort_r and
+ * qsort_template) for every selected (total_size, elem_size, align) tuple of
+ * the sweep run_tests.sh does, but without rebuilding for each one: the
+ * template is instantiated for the whole size x align matrix below at compile
+ * time and configurations are picked at run time. The lists are comma
+ * separated and default to everything run_tests.sh covers; the repeat count
+ * defaults to run_tests.sh's per-tuple choice. Results go to stdout as CSV
+ * with qsort_test's columns (or as JSON), progress to stderr. -l lists the
+ * built-in configurations. */
+
+#define  _ISOC11_SOURCE
+#define _GNU_SOURCE
+
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <error.h>
+#include <assert.h>
+
+#include "qsort.h"
+#include "utils.h"
+
+/* the element sizes and alignments run_tests.sh sweeps: every alignment up to
+ * 32 that divides the size */
+#define BENCH_ALL_ALIGNS(X, size)					\
+	X(size, 1) X(size, 2) X(size, 4) X(size, 8) X(size, 16) X(size, 32)
+
+#define BENCH_CONFIGS(X)						\
+	X(1, 1)								\
+	X(2, 1) X(2, 2)							\
+	X(4, 1) X(4, 2) X(4, 4)						\
+	X(8, 1) X(8, 2) X(8, 4) X(8, 8)					\
+	X(16, 1) X(16, 2) X(16, 4) X(16, 8) X(16, 16)			\
+	X(24, 1) X(24, 2) X(24, 4) X(24, 8)				\
+	BENCH_ALL_ALIGNS(X, 32)						\
+	X(36, 1) X(36, 2) X(36, 4)					\
+	X(40, 1) X(40, 2) X(40, 4) X(40, 8)				\
+	X(48, 1) X(48, 2) X(48, 4) X(48, 8) X(48, 16)			\
+	BENCH_ALL_ALIGNS(X, 64)						\
+	BENCH_ALL_ALIGNS(X, 128)					\
+	BENCH_ALL_ALIGNS(X, 256)					\
+	BENCH_ALL_ALIGNS(X, 512)					\
+	BENCH_ALL_ALIGNS(X, 1024)					\
+	BENCH_ALL_ALIGNS(X, 2048)					\
+	BENCH_ALL_ALIGNS(X, 4096)					\
+	BENCH_ALL_ALIGNS(X, 8192)
+
+/* the total sizes run_tests.sh sweeps */
+static const size_t default_totals[] = {
+	16384, 32768, 65536, 262144, 1048576, 4194304
+};
+
+#define MAX_LIST 64
+
+/* the key qsort_test's my_less and my_cmp compare for an element size */
+static __always_inline uint64_t bench_key(const void *p, size_t size) {
+	if (size == 1)
+		return *(const uint8_t *)p;
+	else if (size == 2)
+		return *(const uint16_t *)p;
+	else if (size < 8)
+		return *(const uint32_t *)p;
+	else
+		return *(const uint64_t *)p;
+}
+
+typedef void (*sort_func_t)(void *p, size_t n, size_t size, int (*compar)(const void *, const void *, void *arg), void *arg);
+
+/* less, cmp, qsort_def and a (noinline, so we can examine its code) sort
+ * function for one configuration */
+#define BENCH_DEFINE(SIZE, ALIGN)					\
+static __always_inline int						\
+less_##SIZE##_##ALIGN(const void *a, const void *b, void *context) {	\
+	return bench_key(__builtin_assume_aligned(a, ALIGN), SIZE)	\
+	     < bench_key(__builtin_assume_aligned(b, ALIGN), SIZE);	\
+}									\
+									\
+static int								\
+cmp_##SIZE##_##ALIGN(const void *a, const void *b, void *context) {	\
+	const uint64_t _a = bench_key(__builtin_assume_aligned(a, ALIGN), SIZE); \
+	const uint64_t _b = bench_key(__builtin_assume_aligned(b, ALIGN), SIZE); \
+									\
+	return _a == _b ? 0 : (_a > _b ? 1 : -1);			\
+}									\
+									\
+static const struct qsort_def def_##SIZE##_##ALIGN = {			\
+	.size = SIZE,							\
+	.align = ALIGN,							\
+	.less = less_##SIZE##_##ALIGN,					\
+};									\
+									\
+static __noinline __flatten void					\
+sort_##SIZE##_##ALIGN(void *p, size_t n, size_t elem_size,		\
+		      int (*compar)(const void *, const void *, void *arg), \
+		      void *arg) {					\
+	int ret = qsort_template(&def_##SIZE##_##ALIGN, p, n, NULL);	\
+									\
+	if (ret)							\
+		fatal_error("qsort_template returned %d\n", ret);	\
+}
+
+BENCH_CONFIGS(BENCH_DEFINE)
+
+#undef BENCH_DEFINE
+
+static const struct bench_config {
+	size_t size;
+	size_t align;
+	sort_func_t sort;
+	int (*cmp)(const void *a, const void *b, void *context);
+} configs[] = {
+#define BENCH_ENTRY(size, align)					\
+	{size, align, sort_##size##_##align, cmp_##size##_##align},
+	BENCH_CONFIGS(BENCH_ENTRY)
+#undef BENCH_ENTRY
+};
+#define CONFIGS_COUNT (sizeof(configs) / sizeof(*configs))
+
+/* run_tests.sh's repeat count for a tuple: more for small arrays and large
+ * elements, fewer for tiny elements */
+static unsigned default_test_count(size_t total_size, size_t size) {
+	unsigned test_count = 512;
+
+	if (total_size <= 16384)
+		test_count *= 4;
+	if (total_size <= 32768)
+		test_count *= 2;
+	if (total_size <= 65536)
+		test_count *= 2;
+
+	if (size == 1)
+		test_count /= 4;
+	if (size == 2)
+		test_count /= 2;
+	if (size > 16)
+		test_count *= 2;
+	if (size > 64)
+		test_count *= 2;
+	if (size > 128)
+		test_count *= 2;
+	if (size > 256)
+		test_count *= 2;
+	if (size > 2048)
+		test_count /= 2;
+
+	return test_count;
+}
+
+/* parse a comma separated list; returns the number of values */
+static size_t parse_list(const char *s, size_t *out, const char *what) {
+	size_t count = 0;
+	char *end;
+
+	do {
+		if (count == MAX_LIST)
+			fatal_error("too many %s", what);
+		errno = 0;
+		out[count++] = strtoul(s, &end, 0);
+		if (errno || end == s || (*end && *end != ','))
+			fatal_error("bad %s list", what);
+		s = end + 1;
+	} while (*end);
+
+	return count;
+}
+
+static int in_list(size_t v, const size_t *list, size_t count) {
+	size_t i;
+
+	if (!count)
+		return 1;
+	for (i = 0; i < count; ++i)
+		if (list[i] == v)
+			return 1;
+	return 0;
+}
+
+/* qsort_test's run_test, without the printing */
+static struct timespec run_test(void *p, size_t n, const struct bench_config *c,
+				unsigned test_count, sort_func_t sortfn) {
+	struct timespec start, end;
+	struct timespec total = {0, 0};
+	unsigned i;
+
+	srandom(0);
+	for (i = test_count; i; --i) {
+		randomize(p, n, c->size, random());
+		timespec_set(&start);
+
+		sortfn(p, n, c->size, c->cmp, NULL);
+
+		timespec_set(&end);
+		total = timespec_add(total, timespec_subtract(end, start));
+	}
+
+	return total;
+}
+
+/* make sure this configuration's qsort_template agrees with _quicksort */
+static void validate(void *a, void *b, size_t n, const struct bench_config *c) {
+	randomize(a, n, c->size, 0);
+	memcpy(b, a, n * c->size);
+	_quicksort(a, n, c->size, c->cmp, NULL);
+	c->sort(b, n, c->size, c->cmp, NULL);
+	if (memcmp(a, b, n * c->size))
+		fatal_error("qsort_template produced different result than _quicksort "
+			    "(elem_size = %lu, align = %lu, n = %lu)", c->size, c->align, n);
+}
+
+static void usage(const char *argv0) {
+	fprintf(stderr, "usage: %s [-s sizes] [-a aligns] [-t total_sizes] [-r repeat_count]\n"
+			"       %*s [-f csv|json] [-l]\n", argv0, (int)strlen(argv0), "");
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+	size_t sizes[MAX_LIST], aligns[MAX_LIST], totals[MAX_LIST];
+	size_t size_count = 0, align_count = 0, total_count = 0;
+	unsigned repeat = 0;
+	int json = 0, list = 0;
+	int first = 1;
+	size_t t, i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:a:t:r:f:l")) != -1) {
+		switch (opt) {
+		case 's':
+			size_count = parse_list(optarg, sizes, "sizes");
+			break;
+		case 'a':
+			align_count = parse_list(optarg, aligns, "aligns");
+			break;
+		case 't':
+			total_count = parse_list(optarg, totals, "total sizes");
+			break;
+		case 'r':
+			repeat = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			if (!strcmp(optarg, "json"))
+				json = 1;
+			else if (strcmp(optarg, "csv"))
+				usage(argv[0]);
+			break;
+		case 'l':
+			list = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind != argc)
+		usage(argv[0]);
+
+	if (list) {
+		printf("elem_size, min_align\n");
+		for (i = 0; i < CONFIGS_COUNT; ++i)
+			printf("%lu, %lu\n", configs[i].size, configs[i].align);
+		return 0;
+	}
+
+	if (!total_count) {
+		total_count = sizeof(default_totals) / sizeof(*default_totals);
+		memcpy(totals, default_totals, sizeof(default_totals));
+	}
+
+	if (json)
+		printf("[");
+	else
+		printf("n, elem_size, min_align, total_bytes, repeat_count, cmp_to_qsort, cmp_to_msort, time_qsort, time_msort, time_mysort\n");
+
+	for (t = 0; t < total_count; ++t) {
+		for (i = 0; i < CONFIGS_COUNT; ++i) {
+			const struct bench_config *c = &configs[i];
+			const size_t n = totals[t] / c->size;
+			struct timespec qsort, msort, mysort;
+			unsigned test_count;
+			void *arr, *tmp;
+
+			if (!in_list(c->size, sizes, size_count)
+			    || !in_list(c->align, aligns, align_count))
+				continue;
+
+			/* If less than 16 elements, then skip the test */
+			if (n < 16)
+				continue;
+
+			test_count = repeat ? repeat : default_test_count(totals[t], c->size);
+			fprintf(stderr, "TEST: elem_size=%lu, align=%lu, num_elems=%lu, test_count=%u, total_size=%lu\n",
+				c->size, c->align, n, test_count, totals[t]);
+
+			arr = aligned_alloc(c->align, n * c->size);
+			tmp = aligned_alloc(c->align, n * c->size);
+			if (unlikely(!arr || !tmp)) {
+				errno = ENOMEM;
+				fatal_error("malloc %lu bytes\n", n * c->size);
+			}
+
+			validate(arr, tmp, n, c);
+
+			qsort  = run_test(arr, n, c, test_count, _quicksort);
+			msort  = run_test(arr, n, c, test_count, qsort_r);
+			mysort = run_test(arr, n, c, test_count, c->sort);
+
+			if (json)
+				printf("%s\n  {\"n\": %lu, \"elem_size\": %lu, \"min_align\": %lu, "
+				       "\"total_bytes\": %lu, \"repeat_count\": %u, "
+				       "\"cmp_to_qsort\": %.2f, \"cmp_to_msort\": %.2f, "
+				       "\"time_qsort\": %lu.%09lu, \"time_msort\": %lu.%09lu, "
+				       "\"time_mysort\": %lu.%09lu}",
+				       first ? "" : ",", n, c->size, c->align,
+				       n * c->size, test_count,
+				       time_pct(&qsort, &mysort), time_pct(&msort, &mysort),
+				       qsort.tv_sec, qsort.tv_nsec,
+				       msort.tv_sec, msort.tv_nsec,
+				       mysort.tv_sec, mysort.tv_nsec);
+			else
+				printf("%lu, %lu, %lu, %lu, %u, %.2f%%, %.2f%%, %lu.%09lu, %lu.%09lu, %lu.%09lu\n",
+				       n, c->size, c->align, n * c->size, test_count,
+				       time_pct(&qsort, &mysort), time_pct(&msort, &mysort),
+				       qsort.tv_sec, qsort.tv_nsec,
+				       msort.tv_sec, msort.tv_nsec,
+				       mysort.tv_sec, mysort.tv_nsec);
+			fflush(stdout);
+			first = 0;
+
+			free(tmp);
+			free(arr);
+		}
+	}
+
+	if (json)
+		printf("\n]\n");
+
+	return 0;
+}
@@ -0,0 +1,503 @@
+/*
+ * qsort_parallel.h - multithreaded work-stealing qsort_template
+ * Copyright (C) 2014 Daniel Santos <daniel.santos@pobox.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/* The array is split by partitioning at the top level. Each thread owns a
+ * deque of partitions still to be sorted: it splits the partition it's
+ * working on, pushes the larger half onto the bottom of its deque and carries
+ * on with the smaller half until it drops below the cutoff, at which point
+ * the sequential qsort_template finishes it off. A thread whose deque is
+ * empty steals from the top (the oldest, and thus largest, partitions) of
+ * the others'. Sorting is done when every element has been accounted for.
+ *
+ * Since a thread's start routine has to be a real function, a sort is
+ * instantiated for a particular struct qsort_def with DEFINE_QSORT_PARALLEL:
+ *
+ *	static const struct qsort_def my_def = { ... };
+ *	DEFINE_QSORT_PARALLEL(my_parallel_sort, my_def)
+ *	...
+ *	ret = my_parallel_sort(base, n, arg, nthreads);
+ *
+ * Link with -pthread.
+ */
+
+#ifndef _QSORT_PARALLEL_H_
+#define _QSORT_PARALLEL_H_
+
+#include <pthread.h>
+#include <sched.h>
+
+#include "qsort.h"
+
+/* Partitions no larger than this are never split up between threads. */
+#ifndef _QSORT_PARALLEL_CUTOFF
+# define _QSORT_PARALLEL_CUTOFF 8192
+#endif
+
+/* Capacity of each thread's deque. Since a thread always carries on with the
+ * smaller half of a split, it only pushes about log2(n / cutoff) partitions
+ * before popping one again. Should a deque fill up anyway, the partition is
+ * just sorted on the spot. */
+#ifndef _QSORT_DEQUE_SIZE
+# define _QSORT_DEQUE_SIZE 64
+#endif
+
+/* Rounds of fruitless stealing, each followed by a sched_yield(), before an
+ * idle thread goes to sleep until there's something to steal. */
+#ifndef _QSORT_PARALLEL_SPIN
+# define _QSORT_PARALLEL_SPIN 16
+#endif
+
+struct qsort_task {
+	char *lo;
+	size_t n;
+	unsigned depth;
+};
+
+struct qsort_deque {
+	pthread_mutex_t lock;
+	size_t top;		/* oldest task, stolen by other threads */
+	size_t bottom;		/* one past the newest, owned by this thread */
+	struct qsort_task tasks[_QSORT_DEQUE_SIZE];
+};
+
+struct qsort_pool {
+	void *arg;
+	char *base;
+	char *index;		/* index for the whole array, or NULL */
+	size_t cutoff;
+	unsigned max_depth;
+	unsigned nthreads;
+	size_t remaining;	/* elements not yet in their final place */
+	size_t queued;		/* tasks in the deques (or about to be) */
+	unsigned sleepers;	/* threads waiting on wake */
+	int started;		/* nthreads is final and the threads may go */
+	int err;
+	pthread_mutex_t lock;	/* for wake and started */
+	pthread_cond_t wake;	/* signalled on a push, the start and the end */
+	struct qsort_deque *deques;
+};
+
+struct qsort_worker {
+	struct qsort_pool *pool;
+	unsigned id;
+	void *elem_buf;
+	struct qsort_stats stats;	/* this thread's, summed at the end */
+	pthread_t thread;
+};
+
+/* push a task onto the bottom of a deque; returns zero if it's full */
+static inline int qsort_deque_push(struct qsort_deque *dq, struct qsort_task t) {
+	int ret = 0;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->bottom < _QSORT_DEQUE_SIZE) {
+		dq->tasks[dq->bottom++] = t;
+		ret = 1;
+	}
+	pthread_mutex_unlock(&dq->lock);
+
+	return ret;
+}
+
+/* pop the newest task off the bottom (owner only) */
+static inline int qsort_deque_pop(struct qsort_deque *dq, struct qsort_task *t) {
+	int ret = 0;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->bottom > dq->top) {
+		*t = dq->tasks[--dq->bottom];
+		ret = 1;
+	}
+	if (dq->bottom == dq->top)
+		dq->bottom = dq->top = 0;
+	pthread_mutex_unlock(&dq->lock);
+
+	return ret;
+}
+
+/* take the oldest task off the top (thieves) */
+static inline int qsort_deque_steal(struct qsort_deque *dq, struct qsort_task *t) {
+	int ret = 0;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->bottom > dq->top) {
+		*t = dq->tasks[dq->top++];
+		ret = 1;
+	}
+	if (dq->bottom == dq->top)
+		dq->bottom = dq->top = 0;
+	pthread_mutex_unlock(&dq->lock);
+
+	return ret;
+}
+
+/* push a task onto a thread's deque and wake a sleeper to steal it; returns
+ * zero if the deque is full */
+static inline int qsort_pool_push(struct qsort_pool *pool, unsigned id,
+				  struct qsort_task t) {
+	/* counted first, so a sleeper can never miss it */
+	__atomic_add_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+	if (!qsort_deque_push(&pool->deques[id], t)) {
+		__atomic_sub_fetch(&pool->queued, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	if (__atomic_load_n(&pool->sleepers, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&pool->lock);
+		pthread_cond_signal(&pool->wake);
+		pthread_mutex_unlock(&pool->lock);
+	}
+	return 1;
+}
+
+/* sleep until there's a task to steal or the sort is done */
+static inline void qsort_pool_wait(struct qsort_pool *pool) {
+	pthread_mutex_lock(&pool->lock);
+	__atomic_add_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&pool->remaining, __ATOMIC_ACQUIRE)
+	       && !__atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST))
+		pthread_cond_wait(&pool->wake, &pool->lock);
+	__atomic_sub_fetch(&pool->sleepers, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static inline void qsort_pool_done(struct qsort_pool *pool, size_t n) {
+	if (__atomic_sub_fetch(&pool->remaining, n, __ATOMIC_ACQ_REL))
+		return;
+
+	/* the last elements are in place: let the sleepers go */
+	pthread_mutex_lock(&pool->lock);
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/* add one thread's counts into the caller's */
+static inline void qsort_stats_merge(struct qsort_stats *dst,
+				     const struct qsort_stats *src) {
+	dst->compares        += src->compares;
+	dst->swaps           += src->swaps;
+	dst->ror_moves       += src->ror_moves;
+	dst->partitions      += src->partitions;
+	if (src->max_stack > dst->max_stack)
+		dst->max_stack = src->max_stack;
+	dst->index_ns        += src->index_ns;
+	dst->perm_cycles     += src->perm_cycles;
+	dst->partition_elems += src->partition_elems;
+	dst->partition_minor += src->partition_minor;
+}
+
+/*
+ * _qsort_parallel_leaf -- finish a task off with the sequential qsort_template
+ *
+ * Large elements are sorted through the slice of the pool's index that
+ * corresponds to the task's elements. Tasks never overlap, so neither do
+ * their slices, and qsort_template has nothing left to allocate.
+ */
+static __always_inline void
+_qsort_parallel_leaf(struct qsort_def *d, struct qsort_pool *pool, char *lo,
+		     size_t n) {
+	const int indirect = _quicksort_indirect_mode(d);
+	char *index = pool->index;
+	int ret;
+
+	/* never true, but lets qsort_template see that it needn't allocate */
+	if (!d->elem_buf || (indirect && !index)) {
+		__atomic_store_n(&pool->err, ENOMEM, __ATOMIC_RELAXED);
+		return;
+	}
+
+	if (indirect)
+		d->index = (void **)(index + (size_t)(lo - pool->base) / d->size
+				     * _quicksort_index_entry_size(indirect));
+
+	ret = qsort_template(d, lo, n, pool->arg);
+	if (ret)
+		__atomic_store_n(&pool->err, ret, __ATOMIC_RELAXED);
+}
+
+/*
+ * _qsort_parallel_split -- partition a task once around a median-of-three
+ *                          pivot
+ * lt_end:      set to the last element of the lower part
+ * gt_start:    set to the first element of the upper part
+ *
+ * Three-way partitioning is used when the sample has equal keys, so heavy
+ * duplication can't produce a string of one-sided splits; the block kernel
+ * is used otherwise. Whatever is left between the two parts is in its final
+ * place.
+ */
+static __always_inline void
+_qsort_parallel_split(const struct qsort_def *def, char *lo, size_t n,
+		      char **lt_end, char **gt_start, void *arg) {
+	const size_t size = def->size;
+	char *hi = lo + (n - 1) * size;
+	char *mid = lo + (n >> 1) * size;
+	int dummy;
+
+	if (_quicksort_less(def, 0, mid, lo, arg))
+		_quicksort_swap(def, mid, lo);
+	if (_quicksort_less(def, 0, hi, mid, arg)) {
+		_quicksort_swap(def, mid, hi);
+		if (_quicksort_less(def, 0, mid, lo, arg))
+			_quicksort_swap(def, mid, lo);
+	}
+
+	_quicksort_swap(def, lo, mid);
+
+	if (!_quicksort_less(def, 0, mid, lo, arg)
+	    || !_quicksort_less(def, 0, lo, hi, arg)) {
+		_quicksort_partition_three_way(def, 0, lo, hi, lt_end, gt_start, arg);
+	} else {
+		char *pivot_pos = _quicksort_partition_block(def, 0, lo, hi, &dummy, arg);
+
+		*lt_end   = pivot_pos - size;
+		*gt_start = pivot_pos + size;
+	}
+}
+
+/*
+ * _qsort_parallel_worker -- body of each sorting thread
+ * def:         the template parameters
+ * self:        this thread's state
+ *
+ * Partitioning is always done directly on the elements; the sequential
+ * qsort_template at the leaves still sorts large elements indirectly. Counts
+ * go into the thread's own stats, as the caller's aren't atomic. A thread
+ * that finds nothing to steal for _QSORT_PARALLEL_SPIN rounds sleeps until
+ * a push or the end of the sort wakes it. Threads wait for every other one
+ * to have been created before they start, so they only ever look at the
+ * deques of threads that exist.
+ */
+static __always_inline void *
+_qsort_parallel_worker(const struct qsort_def *def, struct qsort_worker *self) {
+	struct qsort_pool *pool = self->pool;
+	struct qsort_def d = *def;
+	struct qsort_task t = { NULL, 0, 0 };
+	unsigned i, idle = 0;
+
+	if (!self->elem_buf)
+		return NULL;	/* never happens, but lets gcc see it's set */
+
+	d.elem_buf = self->elem_buf;
+	d.index    = NULL;
+	d.stats    = def->stats ? &self->stats : NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	while (!pool->started)
+		pthread_cond_wait(&pool->wake, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (;;) {
+		if (!qsort_deque_pop(&pool->deques[self->id], &t)) {
+			for (i = 1; i < pool->nthreads; ++i) {
+				unsigned victim = (self->id + i) % pool->nthreads;
+
+				if (qsort_deque_steal(&pool->deques[victim], &t))
+					break;
+			}
+
+			if (i == pool->nthreads) {
+				if (!__atomic_load_n(&pool->remaining, __ATOMIC_ACQUIRE))
+					return NULL;
+				if (++idle < _QSORT_PARALLEL_SPIN)
+					sched_yield();
+				else
+					qsort_pool_wait(pool);
+				continue;
+			}
+		}
+		__atomic_sub_fetch(&pool->queued, 1, __ATOMIC_RELAXED);
+		idle = 0;
+
+		/* split until small enough (or too unlucky) to finish here */
+		while (t.n > pool->cutoff && t.depth < pool->max_depth) {
+			struct qsort_task left, right;
+			char *lt_end, *gt_start;
+
+			_qsort_parallel_split(&d, t.lo, t.n, &lt_end, &gt_start, pool->arg);
+
+			left.lo     = t.lo;
+			left.n      = (size_t)(lt_end + d.size - t.lo) / d.size;
+			left.depth  = t.depth + 1;
+			right.lo    = gt_start;
+			right.n     = (size_t)(t.lo + t.n * d.size - gt_start) / d.size;
+			right.depth = t.depth + 1;
+			qsort_pool_done(pool, t.n - left.n - right.n);
+
+			if (left.n < right.n) {
+				struct qsort_task tmp = left;
+				left = right;
+				right = tmp;
+			}
+
+			/* left is now the larger of the two */
+			if (left.n && !qsort_pool_push(pool, self->id, left)) {
+				_qsort_parallel_leaf(&d, pool, left.lo, left.n);
+				qsort_pool_done(pool, left.n);
+			}
+			t = right;
+		}
+
+		if (t.n > 1)
+			_qsort_parallel_leaf(&d, pool, t.lo, t.n);
+		qsort_pool_done(pool, t.n);
+	}
+}
+
+/**
+ * qsort_parallel_template - sort an array using several threads
+ * @def:      the template parameters
+ * @worker:   thread start routine instantiated for def, see
+ *            DEFINE_QSORT_PARALLEL
+ * @pbase:    the array
+ * @n:        number of elements
+ * @arg:      passed to def->less
+ * @nthreads: number of threads to use, including the calling thread
+ *
+ * def->elem_buf and def->index are ignored: each thread gets its own element
+ * buffer and, for elements large enough to be sorted indirectly, a slice of
+ * an index covering the whole array. All of it is allocated before any
+ * thread starts, so the sort either fails up front or not at all. If threads
+ * can't be created, the remaining ones (at least the caller) do all of the
+ * work. def->stats, if set, receives the sum of every thread's counts.
+ *
+ * Returns zero on success or ENOMEM.
+ */
+static __always_inline __flatten int
+qsort_parallel_template (const struct qsort_def *def, void *(*worker) (void *),
+                         void *const pbase, size_t n, void *arg,
+                         unsigned nthreads)
+{
+  struct qsort_pool pool;
+  struct qsort_worker *workers;
+  struct qsort_task first = { .lo = pbase, .n = n, .depth = 0 };
+  const size_t align = min (def->align, _QSORT_ALIGN_MAX);
+  const size_t buf_size = (def->size + align - 1) & ~(align - 1);
+  const int indirect = _quicksort_indirect_mode (def);
+  char *bufs;
+  unsigned i;
+
+  if (nthreads <= 1 || n <= _QSORT_PARALLEL_CUTOFF)
+    {
+      struct qsort_def d = *def;
+
+      d.elem_buf = NULL;
+      d.index = NULL;
+      return qsort_template (&d, pbase, n, arg);
+    }
+
+  pool.arg       = arg;
+  pool.base      = pbase;
+  pool.index     = NULL;
+  pool.cutoff    = n / (nthreads * 16);
+  if (pool.cutoff < _QSORT_PARALLEL_CUTOFF)
+    pool.cutoff = _QSORT_PARALLEL_CUTOFF;
+  /* 2 * floor (log2 (n)), as for introsort */
+  pool.max_depth = 2 * (sizeof (size_t) * CHAR_BIT - 1 - __builtin_clzl (n));
+  pool.nthreads  = nthreads;
+  pool.remaining = n;
+  pool.queued    = 0;
+  pool.sleepers  = 0;
+  pool.started   = 0;
+  pool.err       = 0;
+
+  /* get all of the memory up front so we can't fail half way through */
+  pool.deques = malloc (sizeof (*pool.deques) * nthreads);
+  workers     = malloc (sizeof (*workers) * nthreads);
+  bufs        = aligned_alloc (align, buf_size * nthreads);
+  if (indirect)
+    pool.index = aligned_alloc (_Alignof (struct _quicksort_prefixed),
+                                _quicksort_index_entry_size (indirect) * n);
+  if (!pool.deques || !workers || !bufs || (indirect && !pool.index))
+    {
+      free (pool.deques);
+      free (workers);
+      free (bufs);
+      free (pool.index);
+      return ENOMEM;
+    }
+
+  for (i = 0; i < nthreads; ++i)
+    {
+      pthread_mutex_init (&pool.deques[i].lock, NULL);
+      pool.deques[i].top    = 0;
+      pool.deques[i].bottom = 0;
+      workers[i].pool       = &pool;
+      workers[i].id         = i;
+      workers[i].elem_buf   = bufs + i * buf_size;
+      memset (&workers[i].stats, 0, sizeof (workers[i].stats));
+    }
+
+  pthread_mutex_init (&pool.lock, NULL);
+  pthread_cond_init (&pool.wake, NULL);
+  qsort_pool_push (&pool, 0, first);
+
+  for (i = 1; i < nthreads; ++i)
+    if (pthread_create (&workers[i].thread, NULL, worker, &workers[i]))
+      break;
+
+  /* only now that it's known how many threads there are do they start */
+  pthread_mutex_lock (&pool.lock);
+  pool.nthreads = i;
+  pool.started  = 1;
+  pthread_cond_broadcast (&pool.wake);
+  pthread_mutex_unlock (&pool.lock);
+
+  /* the calling thread is worker 0 */
+  worker (&workers[0]);
+
+  for (i = 1; i < pool.nthreads; ++i)
+    pthread_join (workers[i].thread, NULL);
+
+  for (i = 0; i < nthreads; ++i)
+    {
+      pthread_mutex_destroy (&pool.deques[i].lock);
+      if (def->stats)
+        qsort_stats_merge (def->stats, &workers[i].stats);
+    }
+  pthread_cond_destroy (&pool.wake);
+  pthread_mutex_destroy (&pool.lock);
+
+  free (pool.index);
+  free (bufs);
+  free (workers);
+  free (pool.deques);
+
+  return pool.err;
+}
+
+/**
+ * DEFINE_QSORT_PARALLEL - instantiate a parallel sort for a struct qsort_def
+ * @name: name of the function to define, which has the signature
+ *        int name(void *base, size_t n, void *arg, unsigned nthreads)
+ * @def:  a struct qsort_def (not a pointer to one) whose members are
+ *        compile-time constants
+ */
+#define DEFINE_QSORT_PARALLEL(name, def)				\
+static __flatten void *name ## _worker(void *p) {			\
+	return _qsort_parallel_worker(&(def), p);			\
+}									\
+									\
+static __flatten int name(void *base, size_t n, void *arg,		\
+			  unsigned nthreads) {				\
+	return qsort_parallel_template(&(def), name ## _worker, base,	\
+				       n, arg, nthreads);		\
+}
+
+#endif /* _QSORT_PARALLEL_H_ */
@@ -0,0 +1,148 @@
+/*
+ * qsort_parallel_test - scaling benchmark for qsort_parallel_template
+ * Copyright (C) 2014 Daniel Santos <daniel.santos@pobox.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/* usage: qsort_parallel_test [num_elems [max_threads [repeat_count]]]
+ *
+ * Sorts the same random data with 1 through max_threads threads and prints
+ * the wall time, speedup and efficiency of each as CSV. Each result is checked
+ * to be sorted and a permutation of its input. A last sort with max_threads
+ * threads prints the summed stats. */
+
+#define  _ISOC11_SOURCE
+#define _GNU_SOURCE
+
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <error.h>
+#include <assert.h>
+
+#include "qsort_parallel.h"
+#include "utils.h"
+#include "test_elem.h"
+
+#ifndef NUM_ELEMS
+# define NUM_ELEMS (16 * 1024 * 1024)
+#endif
+
+static const struct qsort_def my_def = {
+	.size = ELEM_SIZE,
+	.align = ALIGN_SIZE,
+	.less = my_less,
+	.partition = QSORT_PARTITION_BLOCK,
+};
+
+static struct qsort_stats my_stats;
+
+static const struct qsort_def my_counted_def = {
+	.size = ELEM_SIZE,
+	.align = ALIGN_SIZE,
+	.less = my_less,
+	.partition = QSORT_PARTITION_BLOCK,
+	.stats = &my_stats,
+};
+
+DEFINE_QSORT_PARALLEL(my_parallel_sort, my_def)
+DEFINE_QSORT_PARALLEL(my_counted_parallel_sort, my_counted_def)
+
+static double wall_time(void) {
+	struct timespec ts;
+
+	if (unlikely(clock_gettime(CLOCK_MONOTONIC, &ts)))
+		fatal_error("clock_gettime");
+
+	return ts.tv_sec + ts.tv_nsec / 1000000000.;
+}
+
+static void check_sorted(const char *p, size_t n, uint64_t hash,
+			 unsigned nthreads) {
+	size_t i;
+
+	for (i = 1; i < n; ++i)
+		if (my_less(p + i * ELEM_SIZE, p + (i - 1) * ELEM_SIZE, NULL))
+			fatal_error("not sorted at %lu with %u threads", i, nthreads);
+
+	if (multiset_hash(p, n, ELEM_SIZE) != hash)
+		fatal_error("not a permutation of the input with %u threads",
+			    nthreads);
+}
+
+int main(int argc, char **argv) {
+	size_t n = argc > 1 ? strtoul(argv[1], NULL, 0) : NUM_ELEMS;
+	long nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned max_threads = argc > 2 ? strtoul(argv[2], NULL, 0) : (nprocs > 0 ? nprocs : 1);
+	unsigned test_count = argc > 3 ? strtoul(argv[3], NULL, 0) : TEST_COUNT;
+	size_t bytes = n * ELEM_SIZE;
+	double base_time = 0.;
+	uint64_t hash;
+	unsigned nthreads, i;
+	int ret;
+	void *arr;
+
+	arr = aligned_alloc(ALIGN_SIZE, bytes);
+	if (unlikely(!arr)) {
+		errno = ENOMEM;
+		fatal_error("malloc %lu bytes\n", bytes);
+	}
+
+	printf("n = %lu, elem_size = %lu, min_align = %lu, repeat_count = %u\n",
+	       n, (size_t)ELEM_SIZE, (size_t)ALIGN_SIZE, test_count);
+	printf("threads, time, speedup, efficiency\n");
+
+	for (nthreads = 1; nthreads <= max_threads; ++nthreads) {
+		double total = 0.;
+
+		for (i = 0; i < test_count; ++i) {
+			double start;
+
+			randomize(arr, n, ELEM_SIZE, i);
+			hash = multiset_hash(arr, n, ELEM_SIZE);
+			start = wall_time();
+			ret = my_parallel_sort(arr, n, NULL, nthreads);
+			total += wall_time() - start;
+
+			if (ret)
+				fatal_error("my_parallel_sort returned %d\n", ret);
+			check_sorted(arr, n, hash, nthreads);
+		}
+
+		if (nthreads == 1)
+			base_time = total;
+
+		printf("%u, %.6f, %.2f, %.2f%%\n", nthreads, total / test_count,
+		       base_time / total, 100. * base_time / total / nthreads);
+	}
+
+	randomize(arr, n, ELEM_SIZE, 0);
+	hash = multiset_hash(arr, n, ELEM_SIZE);
+	ret = my_counted_parallel_sort(arr, n, NULL, max_threads);
+	if (ret)
+		fatal_error("my_counted_parallel_sort returned %d\n", ret);
+	check_sorted(arr, n, hash, max_threads);
+	printf("stats (%u threads): compares = %lu, swaps = %lu, partitions = %lu, max_stack = %lu\n",
+	       max_threads, (size_t)my_stats.compares, (size_t)my_stats.swaps,
+	       (size_t)my_stats.partitions, (size_t)my_stats.max_stack);
+
+	free(arr);
+	return 0;
+}
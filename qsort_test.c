@@ -26,6 +26,7 @@
 #include <stdio.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sched.h>
 #include <time.h>
 #include <errno.h>
 #include <error.h>
@@ -54,6 +55,15 @@
 # define KEY_SIGN uint
 #endif
 
+/* untimed calls before each test, to fault in memory and warm up caches,
+ * branch predictors and the clock */
+#ifndef WARMUP_COUNT
+# define WARMUP_COUNT 3
+#endif
+
+/* number of elements partial_sort_template is asked for */
+#define partial_k(n) ((n) / 16 ? (n) / 16 : 1)
+
 #define key_type(bits) KEY_SIGN ## bits ## _t
 
 static __always_inline int my_cmp(const void *a, const void *b, void *context) {
@@ -104,23 +114,252 @@ struct size_type {
 };
 #pragma pack(pop)
 
-static const struct qsort_def my_def = {
+typedef void (*sort_func_t)(void *p, size_t n, size_t size, int (*compar)(const void *, const void *, void *arg), void *arg);
+
+/* the key my_less compares, described for the templates that use one */
+#define MY_KEY .key_width = MY_KEY_WIDTH, .key_type = QSORT_KEY_UNSIGNED
+
+/* counts of what the counted variants do, for print_stats */
+static struct qsort_stats my_stats;
+
+/* The variants under test: name (of its sort function, after "my_"),
+ * template, qsort_def, whether print_stats counts it too (1 or 0) and the
+ * fields of the qsort_def beyond size, align and less. my_quicksort must be
+ * first: the others are timed against it. */
+#define MY_SORTS(X)							\
+	X(quicksort, qsort_template, my_def, 1)				\
+	X(introsort, qsort_template, my_intro_def, 0, .introsort = 1)	\
+	X(blocksort, qsort_template, my_block_def, 1,			\
+	  .partition = QSORT_PARTITION_BLOCK)				\
+	X(3waysort, qsort_template, my_3way_def, 0,			\
+	  .partition = QSORT_PARTITION_THREE_WAY)			\
+	X(adaptivesort, qsort_template, my_adaptive_def, 0,		\
+	  .three_way_adaptive = 1)					\
+	/* describes the same key that my_less compares */		\
+	X(radixsort, radix_sort_template, my_radix_def, 0, MY_KEY)	\
+	/* sorting networks only kick in when the key is the whole	\
+	 * element */							\
+	X(networksort, qsort_template, my_network_def, 0, MY_KEY,	\
+	  .network = 1)							\
+	X(msort, msort_template, my_msort_def, 0)			\
+	/* 32-bit element numbers in the partition stack and index */	\
+	X(narrowsort, qsort_template, my_narrow_def, 1,			\
+	  .max_size_bits = 32)						\
+	/* large elements are sorted by an index carrying their keys */	\
+	X(prefixsort, qsort_template, my_prefix_def, 1, MY_KEY,		\
+	  .prefix_cache = 1)						\
+	/* pre-scans for presorted input (and natural runs in		\
+	 * msort_template) */						\
+	X(runsort, qsort_template, my_runs_def, 0, .adaptive = 1)	\
+	X(natural_msort, msort_template, my_natural_def, 0,		\
+	  .adaptive = 1)						\
+	/* galloping insertion in the final insertion sort and msort's	\
+	 * short runs */						\
+	X(binsort, qsort_template, my_binins_def, 1,			\
+	  .binary_insertion = 1)					\
+	X(binmsort, msort_template, my_binmsort_def, 0,			\
+	  .binary_insertion = 1)					\
+	/* Tukey's ninther for larger partitions */			\
+	X(ninthersort, qsort_template, my_ninther_def, 1,		\
+	  .pivot = QSORT_PIVOT_NINTHER)					\
+	/* ninther, and the median of a sqrt(n) sample for huge		\
+	 * partitions */						\
+	X(samplesort, qsort_template, my_sample_def, 1,			\
+	  .pivot = QSORT_PIVOT_ADAPTIVE)				\
+	/* the same, sampling through the index */			\
+	X(prefix_samplesort, qsort_template, my_prefix_sample_def, 1,	\
+	  MY_KEY, .prefix_cache = 1, .pivot = QSORT_PIVOT_ADAPTIVE)
+
+/* a (noinline, so we can examine its code) sort function sorting with tmpl
+ * and def */
+#define MY_SORT_FN(fn, tmpl, def)					\
+static __noinline __flatten void					\
+fn(void *p, size_t n, size_t elem_size,					\
+   int (*compar)(const void *, const void *, void *arg), void *arg) {	\
+	int ret = tmpl(&(def), p, n, NULL);				\
+									\
+	if (ret)							\
+		fatal_error(#tmpl " returned %d\n", ret);		\
+}
+
+/* qsort_def and sort function of one variant and, if counted, of its
+ * counting twin */
+#define MY_DEFINE(name, tmpl, def, counted, ...)			\
+static const struct qsort_def def = {					\
+	.size = ELEM_SIZE,						\
+	.align = ALIGN_SIZE,						\
+	.less = my_less,						\
+	__VA_ARGS__							\
+};									\
+MY_SORT_FN(my_##name, tmpl, def)					\
+MY_DEFINE_COUNTED_##counted(name, tmpl, def, __VA_ARGS__)
+
+#define MY_DEFINE_COUNTED_0(name, tmpl, def, ...)
+#define MY_DEFINE_COUNTED_1(name, tmpl, def, ...)			\
+static const struct qsort_def def##_counted = {				\
+	.size = ELEM_SIZE,						\
+	.align = ALIGN_SIZE,						\
+	.less = my_less,						\
+	.stats = &my_stats,						\
+	__VA_ARGS__							\
+};									\
+MY_SORT_FN(my_counted_##name, tmpl, def##_counted)
+
+MY_SORTS(MY_DEFINE)
+
+/* my_less's key again, as columns for its high and low halves */
+#define MY_HALF (ELEM_SIZE <= 2 ? 1 : ELEM_SIZE < 8 ? 2 : 4)
+
+static const struct qsort_key_col my_key_cols[] = {
+#if ELEM_SIZE == 1
+	{.offset = 0, .width = 1},
+#elif __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	{.offset = 0, .width = MY_HALF},
+	{.offset = MY_HALF, .width = MY_HALF},
+#else
+	{.offset = MY_HALF, .width = MY_HALF},
+	{.offset = 0, .width = MY_HALF},
+#endif
+};
+
+/* ordered by a comparator synthesized from my_key_cols */
+static const struct qsort_def my_keys_def;
+QSORT_KEYS_LESS(my_keys_less, my_keys_def)
+
+static const struct qsort_def my_keys_def = {
 	.size = ELEM_SIZE,
 	.align = ALIGN_SIZE,
-	.less = my_less,
+	.less = my_keys_less,
+	.keys = my_key_cols,
+	.nkeys = sizeof(my_key_cols) / sizeof(*my_key_cols),
 };
 
+/* the same, comparing the normalized key a word at a time */
+static const struct qsort_def my_normkeys_def;
+QSORT_KEYS_LESS(my_normkeys_less, my_normkeys_def)
 
-typedef void (*sort_func_t)(void *p, size_t n, size_t size, int (*compar)(const void *, const void *, void *arg), void *arg);
+static const struct qsort_def my_normkeys_def = {
+	.size = ELEM_SIZE,
+	.align = ALIGN_SIZE,
+	.less = my_normkeys_less,
+	.keys = my_key_cols,
+	.nkeys = sizeof(my_key_cols) / sizeof(*my_key_cols),
+	.key_normalize = 1,
+};
+
+MY_SORT_FN(my_keysort, qsort_template, my_keys_def)
+MY_SORT_FN(my_normkeysort, qsort_template, my_normkeys_def)
 
-/* using static noinline to make it easier to examine generated code */
-static __noinline __flatten void my_quicksort(void *p, size_t n, size_t elem_size, int (*compar)(const void *, const void *, void *arg), void *arg) {
+/* reuses its scratch space from one run to the next */
+static struct qsort_ctx my_ctx = QSORT_CTX_INIT;
+
+static __noinline __flatten void my_ctxsort(void *p, size_t n, size_t elem_size, int (*compar)(const void *, const void *, void *arg), void *arg) {
+	int ret = qsort_ctx_template(&my_def, &my_ctx, p, n, NULL);
+
+	if (ret)
+		fatal_error("qsort_ctx_template returned %d\n", ret);
+}
+
+/* selects the median */
+static __noinline __flatten void my_select(void *p, size_t n, size_t elem_size, int (*compar)(const void *, const void *, void *arg), void *arg) {
+	int ret = select_template(&my_def, p, n, n / 2, NULL);
+
+	if (ret)
+		fatal_error("select_template returned %d\n", ret);
+}
+
+static __noinline __flatten void my_partial_sort(void *p, size_t n, size_t elem_size, int (*compar)(const void *, const void *, void *arg), void *arg) {
+	int ret = partial_sort_template(&my_def, p, n, partial_k(n), NULL);
+
+	if (ret)
+		fatal_error("partial_sort_template returned %d\n", ret);
+}
+
+/* what partial_sort_template replaces: sort everything, keep the front */
+static void *prefix_out;
+
+static __noinline __flatten void my_sort_prefix(void *p, size_t n, size_t elem_size, int (*compar)(const void *, const void *, void *arg), void *arg) {
 	int ret = qsort_template(&my_def, p, n, NULL);
 
 	if (ret)
 		fatal_error("qsort_template returned %d\n", ret);
+	memcpy(prefix_out, p, partial_k(n) * elem_size);
 }
 
+/* sorting into a separate buffer: qsort_copy_template against what it
+ * replaces, copying and then sorting the copy */
+static void *copy_out;
+
+static __noinline __flatten void my_copy_then_sort(void *p, size_t n, size_t elem_size, int (*compar)(const void *, const void *, void *arg), void *arg) {
+	int ret;
+
+	memcpy(copy_out, p, n * elem_size);
+	ret = qsort_template(&my_def, copy_out, n, NULL);
+	if (ret)
+		fatal_error("qsort_template returned %d\n", ret);
+}
+
+static __noinline __flatten void my_copysort(void *p, size_t n, size_t elem_size, int (*compar)(const void *, const void *, void *arg), void *arg) {
+	int ret = qsort_copy_template(&my_def, p, copy_out, n, NULL);
+
+	if (ret)
+		fatal_error("qsort_copy_template returned %d\n", ret);
+}
+
+static __noinline __flatten void my_narrow_copysort(void *p, size_t n, size_t elem_size, int (*compar)(const void *, const void *, void *arg), void *arg) {
+	int ret = qsort_copy_template(&my_narrow_def, p, copy_out, n, NULL);
+
+	if (ret)
+		fatal_error("qsort_copy_template returned %d\n", ret);
+}
+
+static __noinline __flatten void my_prefix_copysort(void *p, size_t n, size_t elem_size, int (*compar)(const void *, const void *, void *arg), void *arg) {
+	int ret = qsort_copy_template(&my_prefix_def, p, copy_out, n, NULL);
+
+	if (ret)
+		fatal_error("qsort_copy_template returned %d\n", ret);
+}
+
+static const struct {
+	const char *desc;
+	sort_func_t fn;
+} my_copysorts[] = {
+	{"my_copysort", my_copysort},
+	{"my_narrow_copysort", my_narrow_copysort},
+	{"my_prefix_copysort", my_prefix_copysort},
+};
+#define MY_COPYSORTS_COUNT (sizeof(my_copysorts) / sizeof(*my_copysorts))
+
+/* the variants under test */
+static const struct {
+	const char *desc;
+	sort_func_t fn;
+} my_sorts[] = {
+#define MY_ENTRY(name, tmpl, def, counted, ...) {"my_" #name, my_##name},
+	MY_SORTS(MY_ENTRY)
+#undef MY_ENTRY
+	{"my_ctxsort", my_ctxsort},
+	{"my_keysort", my_keysort},
+	{"my_normkeysort", my_normkeysort},
+};
+#define MY_SORTS_COUNT (sizeof(my_sorts) / sizeof(*my_sorts))
+
+/* the same, counting into my_stats */
+static const struct {
+	const char *desc;
+	sort_func_t fn;
+} my_counted_sorts[] = {
+#define MY_COUNTED_ENTRY(name, tmpl, def, counted, ...)			\
+	MY_COUNTED_ENTRY_##counted(name)
+#define MY_COUNTED_ENTRY_0(name)
+#define MY_COUNTED_ENTRY_1(name) {"my_" #name, my_counted_##name},
+	MY_SORTS(MY_COUNTED_ENTRY)
+#undef MY_COUNTED_ENTRY_1
+#undef MY_COUNTED_ENTRY_0
+#undef MY_COUNTED_ENTRY
+};
+#define MY_COUNTED_SORTS_COUNT (sizeof(my_counted_sorts) / sizeof(*my_counted_sorts))
+
 static void dump_keys(void * const data[4], size_t n, const char *heading) {
 	size_t i;
 
@@ -168,12 +407,13 @@ static void dump_keys(void * const data[4], size_t n, const char *heading) {
 }
 
 /* Make sure that _quicksort_template() is correct given these parameters */
-void validate_sort(size_t n, size_t elem_size, size_t min_align, unsigned int seed) {
+void validate_sort(size_t n, size_t elem_size, size_t min_align, unsigned int seed,
+		   const struct dist *dist) {
 	void *data[4];
 	const char *algo_desc[4] = {"orig", "my_quicksort", "_quicksoft", "qsort_r"};
 	const size_t DATA_SIZE = sizeof(data) / sizeof(*data);
 	size_t bytes = n * elem_size;
-	size_t i;
+	size_t i, j;
 
 	BUILD_BUG_ON(sizeof(struct size_type) != ELEM_SIZE);
 
@@ -183,8 +423,8 @@ void validate_sort(size_t n, size_t elem_size, size_t min_align, unsigned int se
 		assert(!((uintptr_t)data[i] & (min_align - 1)));
 	}
 
-	/* randomize first buffer */
-	randomize(data[0], n, elem_size, seed);
+	/* fill first buffer */
+	generate(data[0], n, elem_size, dist, seed);
 
 	/* and copy to the other buffers */
 	for (i = 1; i < DATA_SIZE; ++i) {
@@ -195,21 +435,26 @@ void validate_sort(size_t n, size_t elem_size, size_t min_align, unsigned int se
 	if (0)
 		dump_keys(data[0], n, "BEFORE");
 
-	my_quicksort(data[1], n, elem_size, my_cmp, NULL);
 	_quicksort  (data[2], n, elem_size, my_cmp, NULL);
 	qsort_r     (data[3], n, elem_size, my_cmp, NULL);
 
+	for (j = 0; j < MY_SORTS_COUNT; ++j) {
+		memcpy(data[1], data[0], bytes);
+		my_sorts[j].fn(data[1], n, elem_size, my_cmp, NULL);
+
 #if 0
-	/* un-comment to induce error */
-	*((int*)data[1]) -= 1;
+		/* un-comment to induce error */
+		*((int*)data[1]) -= 1;
 #endif
 
-	/* compare result of my_quicksort against results of other algos */
-	for (i = 2; i < DATA_SIZE - 1; ++i) {
-		if (memcmp(data[1], data[i], bytes)) {
-			dump_keys(data, n, "");
-			fprintf(stderr, "\n");
-			fatal_error("\nmy_quicksort produced different result than %s", algo_desc[i]);
+		/* compare result of my_sorts[j] against results of other algos */
+		for (i = 2; i < DATA_SIZE - 1; ++i) {
+			if (memcmp(data[1], data[i], bytes)) {
+				dump_keys(data, n, "");
+				fprintf(stderr, "\n");
+				fatal_error("\n%s produced different result than %s (%s input)",
+					    my_sorts[j].desc, algo_desc[i], dist_name(dist->kind));
+			}
 		}
 	}
 
@@ -217,13 +462,171 @@ void validate_sort(size_t n, size_t elem_size, size_t min_align, unsigned int se
 		free (data[i]);
 }
 
+/* Make sure select_template and partial_sort_template agree with a full
+ * sort */
+void validate_select(size_t n, size_t elem_size, size_t min_align, unsigned int seed) {
+	const size_t k = n / 2;
+	const size_t pk = partial_k(n);
+	size_t bytes = n * elem_size;
+	char *orig, *sorted, *mine;
+	size_t i;
+
+	/* no element to select */
+	if (!n)
+		return;
+
+	orig   = aligned_alloc(min_align, bytes);
+	sorted = aligned_alloc(min_align, bytes);
+	mine   = aligned_alloc(min_align, bytes);
+	if (!orig || !sorted || !mine)
+		fatal_error("malloc %lu bytes\n", bytes);
+
+	randomize(orig, n, elem_size, seed);
+	memcpy(sorted, orig, bytes);
+	_quicksort(sorted, n, elem_size, my_cmp, NULL);
+
+	memcpy(mine, orig, bytes);
+	my_select(mine, n, elem_size, my_cmp, NULL);
+	if (memcmp(mine + k * elem_size, sorted + k * elem_size, elem_size))
+		fatal_error("my_select chose the wrong element for k = %lu", k);
+	for (i = 0; i < n; ++i) {
+		if (i < k && my_less(mine + k * elem_size, mine + i * elem_size, NULL))
+			fatal_error("my_select left a larger element at %lu", i);
+		if (i > k && my_less(mine + i * elem_size, mine + k * elem_size, NULL))
+			fatal_error("my_select left a smaller element at %lu", i);
+	}
+
+	memcpy(mine, orig, bytes);
+	my_partial_sort(mine, n, elem_size, my_cmp, NULL);
+	if (memcmp(mine, sorted, pk * elem_size))
+		fatal_error("my_partial_sort produced different result than _quicksort");
+	for (i = pk; i < n; ++i)
+		if (my_less(mine + i * elem_size, mine + (pk - 1) * elem_size, NULL))
+			fatal_error("my_partial_sort left a smaller element at %lu", i);
+
+	free(orig);
+	free(sorted);
+	free(mine);
+}
+
 static void print_result(struct timespec *total, const char *desc) {
 	printf("%16s = %02lu:%02lu.%09lu\n", desc, total->tv_sec / 60, total->tv_sec % 60, total->tv_nsec);
 }
 
-struct timespec run_test(void *p, size_t n, size_t elem_size, size_t min_align, unsigned int seed, unsigned test_count, sort_func_t sortfn, const char *desc) {
-	struct timespec start, end;
-	struct timespec total = {0, 0};
+/* performance counters read around each sort when run with -p */
+static struct perf_group perf = {
+	.leader = -1,
+	.fd = {[0 ... PERF_COUNTER_COUNT - 1] = -1},
+};
+
+/* print the per call average of each available counter */
+static void print_perf(unsigned test_count) {
+	const char *sep = "";
+	int c;
+
+	printf("%16s   ", "");
+	for (c = 0; c < PERF_COUNTER_COUNT; ++c) {
+		if (perf.fd[c] < 0)
+			continue;
+		printf("%s%s = %.0f", sep, perf_counter_name(c),
+		       (double)perf.total[c] / test_count);
+		sep = ", ";
+	}
+	if (perf.fd[PERF_CYCLES] >= 0 && perf.fd[PERF_INSTRUCTIONS] >= 0
+	    && perf.total[PERF_CYCLES])
+		printf(" (%.2f IPC)", (double)perf.total[PERF_INSTRUCTIONS]
+				      / perf.total[PERF_CYCLES]);
+	printf("\n");
+}
+
+/* copy_out must hold the sorted array and the source be left as it was */
+void validate_copy(size_t n, size_t elem_size, size_t min_align, unsigned int seed) {
+	size_t bytes = n * elem_size;
+	char *orig, *sorted, *src;
+	size_t i;
+
+	orig   = aligned_alloc(min_align, bytes);
+	sorted = aligned_alloc(min_align, bytes);
+	src    = aligned_alloc(min_align, bytes);
+	if (!orig || !sorted || !src)
+		fatal_error("malloc %lu bytes\n", bytes);
+
+	randomize(orig, n, elem_size, seed);
+	memcpy(sorted, orig, bytes);
+	_quicksort(sorted, n, elem_size, my_cmp, NULL);
+
+	for (i = 0; i < MY_COPYSORTS_COUNT; ++i) {
+		memcpy(src, orig, bytes);
+		my_copysorts[i].fn(src, n, elem_size, my_cmp, NULL);
+		if (memcmp(src, orig, bytes))
+			fatal_error("%s modified its source", my_copysorts[i].desc);
+		if (memcmp(copy_out, sorted, bytes))
+			fatal_error("%s produced different result than _quicksort", my_copysorts[i].desc);
+	}
+
+	free(orig);
+	free(sorted);
+	free(src);
+}
+
+/* Sort one random array with each counted variant and print what it took.
+ * The counts don't depend on timing, so once is enough. */
+void print_stats(void *p, size_t n, size_t elem_size, unsigned int seed) {
+	size_t i;
+
+	printf("\n%20s %12s %12s %12s %10s %9s %12s %11s %7s\n", "stats",
+	       "compares", "swaps", "ror_moves", "partitions", "max_stack",
+	       "index_ns", "perm_cycles", "balance");
+
+	for (i = 0; i < MY_COUNTED_SORTS_COUNT; ++i) {
+		randomize(p, n, elem_size, seed);
+		memset(&my_stats, 0, sizeof(my_stats));
+		my_counted_sorts[i].fn(p, n, elem_size, my_cmp, NULL);
+
+		/* smaller side of the average split; 0.5 is perfect */
+		printf("%20s %12lu %12lu %12lu %10lu %9lu %12lu %11lu %7.4f\n",
+		       my_counted_sorts[i].desc, my_stats.compares, my_stats.swaps,
+		       my_stats.ror_moves, my_stats.partitions, my_stats.max_stack,
+		       my_stats.index_ns, my_stats.perm_cycles,
+		       my_stats.partition_elems
+		       ? (double)my_stats.partition_minor / my_stats.partition_elems
+		       : 0.);
+	}
+}
+
+/* total CPU time of a test and the statistics of its per call CPU times */
+struct test_result {
+	struct timespec total;
+	struct sample_stats cpu;
+};
+
+static unsigned warmup_count = WARMUP_COUNT;
+
+/* per call samples of the current test */
+static struct latency_hist cpu_hist, wall_hist;
+
+static void print_hist(const struct latency_hist *h, const char *clock) {
+	printf("%16s   %-4s ns: p50 = %lu, p90 = %lu, p99 = %lu, p99.9 = %lu, mean = %.0f +- %.0f (95%% CI)\n",
+	       "", clock, hist_percentile(h, 50.), hist_percentile(h, 90.),
+	       hist_percentile(h, 99.), hist_percentile(h, 99.9),
+	       h->stats.mean, sample_ci95(&h->stats));
+}
+
+/* "x% faster than desc", saying whether the per call CPU times differ
+ * significantly by Welch's t-test */
+static void print_faster(const struct test_result *base, const struct test_result *t,
+			 const char *desc, const char *end) {
+	struct timespec a = base->total, b = t->total;
+	double tstat;
+	int significant = welch_t_test(&base->cpu, &t->cpu, &tstat);
+
+	printf("%.2f%% faster than %s (%s, t = %.2f)%s", time_pct(&a, &b), desc,
+	       significant ? "p < 0.05" : "not significant", tstat, end);
+}
+
+struct test_result run_test(void *p, size_t n, size_t elem_size, size_t min_align, unsigned int seed, unsigned test_count, const struct dist *dist, sort_func_t sortfn, const char *desc) {
+	struct timespec start, end, wall_start, wall_end;
+	struct test_result ret = {{0, 0}, {0, 0., 0.}};
 	size_t i;
 
 	assert_early(!((uintptr_t)p & (min_align - 1)));
@@ -238,26 +641,68 @@ struct timespec run_test(void *p, size_t n, size_t elem_size, size_t min_align,
 		   desc, n, elem_size, min_align, n * elem_size, test_count);
 #endif
 
+	for (i = 0; i < warmup_count; ++i) {
+		generate(p, n, elem_size, dist, i);
+		sortfn(p, n, elem_size, my_cmp, NULL);
+	}
+
+	memset(perf.total, 0, sizeof(perf.total));
+	hist_reset(&cpu_hist);
+	hist_reset(&wall_hist);
+
 	srandom(0);
 	for (i = test_count; i ; --i) {
+		struct timespec cpu;
 
-		randomize(p, n, elem_size, random());
+		generate(p, n, elem_size, dist, random());
+		perf_start(&perf);
+		clock_gettime(CLOCK_MONOTONIC, &wall_start);
 		timespec_set(&start);
 
 		sortfn(p, n, elem_size, my_cmp, NULL);
 
 		timespec_set(&end);
-		total = timespec_add(total, timespec_subtract(end, start));
+		clock_gettime(CLOCK_MONOTONIC, &wall_end);
+		perf_stop(&perf);
+
+		cpu = timespec_subtract(end, start);
+		ret.total = timespec_add(ret.total, cpu);
+		hist_add(&cpu_hist, timespec_ns(cpu));
+		hist_add(&wall_hist, timespec_ns(timespec_subtract(wall_end, wall_start)));
 	}
+	ret.cpu = cpu_hist.stats;
 
-	print_result(&total, desc);
+	print_result(&ret.total, desc);
+	print_hist(&cpu_hist, "cpu");
+	print_hist(&wall_hist, "wall");
+	if (perf.leader >= 0)
+		print_perf(test_count);
 
-	return total;
+	return ret;
 }
 
+/* usage: qsort_test [-a] [-p] [-c cpu] [-w warmup_count] [dist[:param] ...]
+ *
+ * Validates every variant on each named input distribution (see enum
+ * dist_kind in utils.h for the names), on all of them with -a, or else on
+ * uniform random input only, and reports qsort_template, _quicksort and
+ * qsort_r timings for each. The remaining
+ * benchmarks use uniform random input. With -p, each timing is followed by
+ * the per sort averages of whatever hardware counters perf_event_open can
+ * provide (see enum perf_counter in utils.h). Every timing comes with
+ * percentiles and a confidence interval of the per call CPU and wall clock
+ * times, and every comparison with whether it is significant. -c pins the
+ * process to one CPU and -w sets the number of untimed calls that precede
+ * each test (WARMUP_COUNT by default). */
 int main(int argc, char **argv) {
+	static const struct dist random_dist = {DIST_RANDOM, 0};
+	struct dist *dists;
+	size_t dist_count;
 	void *arr;
-	struct timespec qsort, msort, mysort;
+	struct test_result qsort, msort, mysort;
+	size_t i;
+	int all_dists = 0;
+	int opt;
 
 	/* verify that we have forced the object to whatever size we've
 	 * specified, even if it's stupid */
@@ -275,30 +720,152 @@ int main(int argc, char **argv) {
 		   (size_t)NUM_ELEMS, (size_t)ELEM_SIZE, (size_t)ALIGN_SIZE,
 		   (size_t)ELEM_SIZE * (size_t)NUM_ELEMS, (size_t)TEST_COUNT);
 
-	validate_sort(NUM_ELEMS, ELEM_SIZE, ALIGN_SIZE, 0);
+	while ((opt = getopt(argc, argv, "apc:w:")) != -1) {
+		cpu_set_t set;
+
+		switch (opt) {
+		case 'a':
+			all_dists = 1;
+			break;
+		case 'p':
+			if (!perf_open(&perf)) {
+				fprintf(stderr, "perf events unavailable (%s), continuing without them\n",
+					strerror(errno));
+				break;
+			}
+			for (i = 0; i < PERF_COUNTER_COUNT; ++i)
+				if (perf.fd[i] < 0)
+					fprintf(stderr, "perf event %s unavailable\n",
+						perf_counter_name(i));
+			break;
+		case 'c':
+			CPU_ZERO(&set);
+			CPU_SET(strtoul(optarg, NULL, 0), &set);
+			if (sched_setaffinity(0, sizeof(set), &set))
+				fprintf(stderr, "can't pin to cpu %s (%s), continuing unpinned\n",
+					optarg, strerror(errno));
+			break;
+		case 'w':
+			warmup_count = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-a] [-p] [-c cpu] [-w warmup_count] [dist[:param] ...]\n",
+				argv[0]);
+			return 2;
+		}
+	}
+
+	/* the sweep over every distribution is opt-in: run_tests.sh runs this
+	 * for every tuple */
+	dist_count = argc > optind ? (size_t)(argc - optind)
+		   : all_dists ? DIST_COUNT : 1;
+	dists = calloc(dist_count, sizeof(*dists));
+	if (unlikely(!dists)) {
+		errno = ENOMEM;
+		fatal_error("malloc %lu bytes\n", dist_count * sizeof(*dists));
+	}
+	for (i = 0; i < dist_count; ++i) {
+		if (argc <= optind)
+			dists[i] = all_dists ? (struct dist){i, 0} : random_dist;
+		else if (dist_parse(&dists[i], argv[optind + i])) {
+			errno = EINVAL;
+			fatal_error("unknown distribution %s", argv[optind + i]);
+		}
+	}
+
+	for (i = 0; i < dist_count; ++i)
+		validate_sort(NUM_ELEMS, ELEM_SIZE, ALIGN_SIZE, 0, &dists[i]);
+	validate_select(NUM_ELEMS, ELEM_SIZE, ALIGN_SIZE, 0);
 
 	arr = aligned_alloc(ALIGN_SIZE, ELEM_SIZE * (size_t)NUM_ELEMS);
-	if (unlikely(!arr)) {
+	prefix_out = aligned_alloc(ALIGN_SIZE, ELEM_SIZE * partial_k((size_t)NUM_ELEMS));
+	copy_out = aligned_alloc(ALIGN_SIZE, ELEM_SIZE * (size_t)NUM_ELEMS);
+	if (unlikely(!arr || !prefix_out || !copy_out)) {
 		errno = ENOMEM;
 		fatal_error("malloc %lu bytes\n", ELEM_SIZE * (size_t)NUM_ELEMS);
 	}
 
-	qsort  = run_test(arr, NUM_ELEMS, ELEM_SIZE, ALIGN_SIZE, 0, TEST_COUNT, _quicksort, "_quicksort");
-	msort  = run_test(arr, NUM_ELEMS, ELEM_SIZE, ALIGN_SIZE, 0, TEST_COUNT, qsort_r, "qsort_r");
-	mysort = run_test(arr, NUM_ELEMS, ELEM_SIZE, ALIGN_SIZE, 0, TEST_COUNT, my_quicksort, "my_quicksort");
+	qsort  = run_test(arr, NUM_ELEMS, ELEM_SIZE, ALIGN_SIZE, 0, TEST_COUNT, &random_dist, _quicksort, "_quicksort");
+	msort  = run_test(arr, NUM_ELEMS, ELEM_SIZE, ALIGN_SIZE, 0, TEST_COUNT, &random_dist, qsort_r, "qsort_r");
+	mysort = run_test(arr, NUM_ELEMS, ELEM_SIZE, ALIGN_SIZE, 0, TEST_COUNT, &random_dist, my_quicksort, "my_quicksort");
+
+	print_faster(&qsort, &mysort, "_quicksort", "\n");
+	print_faster(&msort, &mysort, "qsort_r", "\n");
+
+	/* the same on each structured distribution */
+	for (i = 0; i < dist_count; ++i) {
+		const struct dist *d = &dists[i];
+		struct test_result q, m, t;
+
+		if (d->kind == DIST_RANDOM)
+			continue;
+
+		printf("\ndistribution = %s", dist_name(d->kind));
+		if (dist_param(d))
+			printf(":%u", dist_param(d));
+		printf("\n");
+
+		q = run_test(arr, NUM_ELEMS, ELEM_SIZE, ALIGN_SIZE, 0, TEST_COUNT, d, _quicksort, "_quicksort");
+		m = run_test(arr, NUM_ELEMS, ELEM_SIZE, ALIGN_SIZE, 0, TEST_COUNT, d, qsort_r, "qsort_r");
+		t = run_test(arr, NUM_ELEMS, ELEM_SIZE, ALIGN_SIZE, 0, TEST_COUNT, d, my_quicksort, "my_quicksort");
+
+		print_faster(&q, &t, "_quicksort", ", ");
+		print_faster(&m, &t, "qsort_r", "\n");
+	}
+	printf("\n");
+
+	/* the remaining variants, compared against the plain template */
+	for (i = 1; i < MY_SORTS_COUNT; ++i) {
+		struct test_result t = run_test(arr, NUM_ELEMS, ELEM_SIZE, ALIGN_SIZE, 0, TEST_COUNT, &random_dist,
+						my_sorts[i].fn, my_sorts[i].desc);
+
+		print_faster(&qsort, &t, "_quicksort", ", ");
+		print_faster(&msort, &t, "qsort_r", ", ");
+		print_faster(&mysort, &t, "my_quicksort", "\n");
+	}
+
+	print_stats(arr, NUM_ELEMS, ELEM_SIZE, 0);
+
+	/* sorting into another buffer, against copying and sorting the copy */
+	validate_copy(NUM_ELEMS, ELEM_SIZE, ALIGN_SIZE, 0);
+	{
+		struct test_result copy = run_test(arr, NUM_ELEMS, ELEM_SIZE, ALIGN_SIZE, 0, TEST_COUNT, &random_dist,
+						my_copy_then_sort, "my_copy_then_sort");
 
-	printf("%.2f%% faster than _quicksort\n", time_pct(&qsort, &mysort));
-	printf("%.2f%% faster than qsort_r\n", time_pct(&msort, &mysort));
+		for (i = 0; i < MY_COPYSORTS_COUNT; ++i) {
+			struct test_result t = run_test(arr, NUM_ELEMS, ELEM_SIZE, ALIGN_SIZE, 0, TEST_COUNT, &random_dist,
+							my_copysorts[i].fn, my_copysorts[i].desc);
+
+			print_faster(&copy, &t, "my_copy_then_sort", "\n");
+		}
+	}
+
+	/* selection, against sorting the whole array */
+	{
+		struct test_result sel, part, prefix;
+
+		sel    = run_test(arr, NUM_ELEMS, ELEM_SIZE, ALIGN_SIZE, 0, TEST_COUNT, &random_dist, my_select, "my_select");
+		print_faster(&mysort, &sel, "my_quicksort", "\n");
+		prefix = run_test(arr, NUM_ELEMS, ELEM_SIZE, ALIGN_SIZE, 0, TEST_COUNT, &random_dist, my_sort_prefix, "my_sort_prefix");
+		part   = run_test(arr, NUM_ELEMS, ELEM_SIZE, ALIGN_SIZE, 0, TEST_COUNT, &random_dist, my_partial_sort, "my_partial_sort");
+		print_faster(&prefix, &part, "my_sort_prefix", "");
+		printf(" (k = %lu)\n", (size_t)partial_k(NUM_ELEMS));
+	}
 
 	printf("\n\nn, elem_size, min_align, total_bytes, repeat_count, cmp_to_qsort, cmp_to_msort, time_qsort, time_msort, time_mysort\n");
 	printf("%lu, %lu, %lu, %lu, %lu, %.2f%%, %.2f%%, %lu.%09lu, %lu.%09lu, %lu.%09lu\n",
 		   (size_t)NUM_ELEMS, (size_t)ELEM_SIZE, (size_t)ALIGN_SIZE,
 		   (size_t)ELEM_SIZE * (size_t)NUM_ELEMS, (size_t)TEST_COUNT,
-		   time_pct(&qsort, &mysort), time_pct(&msort, &mysort),
-		   qsort.tv_sec, qsort.tv_nsec,
-		   msort.tv_sec, msort.tv_nsec,
-		   mysort.tv_sec, mysort.tv_nsec);
-
+		   time_pct(&qsort.total, &mysort.total), time_pct(&msort.total, &mysort.total),
+		   qsort.total.tv_sec, qsort.total.tv_nsec,
+		   msort.total.tv_sec, msort.total.tv_nsec,
+		   mysort.total.tv_sec, mysort.total.tv_nsec);
+
+	qsort_ctx_destroy (&my_ctx);
+	perf_close (&perf);
+	free (dists);
+	free (copy_out);
+	free (prefix_out);
 	free (arr);
 	return 0;
 }
@@ -18,6 +18,14 @@
 # along with this program; if not, write to the Free Software Foundation,
 # Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
 
+# This rebuilds qsort_test for every tuple so that all of its variants are
+# checked. For timings alone, qsort_bench runs the same sweep from one binary,
+# e.g. ./qsort_bench -s 1,2 -f json > out.json
+
+# Element sizes to test; override to run a subset, e.g. the duplicate-heavy
+# small key sizes with SIZES="1 2" ./run_tests.sh
+SIZES="${SIZES:-1 2 4 8 16 24 32 36 40 48 64 128 256 512 1024 2048 4096 8192}"
+
 CFLAGS="-std=gnu11 -march=native -g3 -pipe -Wall -Wextra -Wcast-align -Wno-unused-parameter -O2 -DNDEBUG"
 
 die() {
@@ -31,14 +39,14 @@ build() {
 	set -x
 	gcc ${CFLAGS} ${CPPFLAGS} -o CMakeFiles/qsort_test.dir/glibc_qsort.o -c ../glibc_qsort.c || die
 	gcc ${CFLAGS} ${CPPFLAGS} -o CMakeFiles/qsort_test.dir/qsort_test.o -c ../qsort_test.c || die
-	gcc ${CFLAGS} ${CPPFLAGS} CMakeFiles/qsort_test.dir/{glibc_qsort,qsort_test}.o -o qsort_test -rdynamic || die
+	gcc ${CFLAGS} ${CPPFLAGS} CMakeFiles/qsort_test.dir/{glibc_qsort,qsort_test}.o -o qsort_test -rdynamic -lm || die
 	set +x
 }
 
 run_tests() {
 	for total_size in 16384 32768 65536 262144 1048576 4194304; do
 		echo "total_size = ${total_size}"
-		for size in 1 2 4 8 16 24 32 36 40 48 64 128 256 512 1024 2048 4096 8192; do
+		for size in ${SIZES}; do
 			typeset -i num_elems
 			echo "size = ${size}"
 
@@ -0,0 +1,43 @@
+/*
+ *
+ * The element the tests and benchmarks (other than qsort_test) sort: ELEM_SIZE
+ * bytes aligned to ALIGN_SIZE, ordered by an unsigned key of MY_KEY_WIDTH
+ * bytes at their start, as generate() writes it. Define any of ELEM_SIZE,
+ * ALIGN_SIZE or TEST_COUNT before including this to change its default. */
+
+#ifndef _TEST_ELEM_H_
+#define _TEST_ELEM_H_
+
+#include <stdint.h>
+
+#include "compiler.h"
+#include "utils.h"
+
+#ifndef ELEM_SIZE
+# define ELEM_SIZE 8
+#endif
+
+#ifndef ALIGN_SIZE
+# define ALIGN_SIZE 8
+#endif
+
+#ifndef TEST_COUNT
+# define TEST_COUNT 3
+#endif
+
+static __always_inline uint64_t my_key(const void *p) {
+	if (MY_KEY_WIDTH == 1)
+		return *(const uint8_t *)__builtin_assume_aligned(p, ALIGN_SIZE);
+	else if (MY_KEY_WIDTH == 2)
+		return *(const uint16_t *)__builtin_assume_aligned(p, ALIGN_SIZE);
+	else if (MY_KEY_WIDTH == 4)
+		return *(const uint32_t *)__builtin_assume_aligned(p, ALIGN_SIZE);
+	else
+		return *(const uint64_t *)__builtin_assume_aligned(p, ALIGN_SIZE);
+}
+
+static __always_inline int my_less(const void *a, const void *b, void *context) {
+	return my_key(a) < my_key(b);
+}
+
+#endif /* _TEST_ELEM_H_ */
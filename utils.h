@@ -8,6 +8,13 @@
 #include <error.h>
 #include <errno.h>
 #include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
 
 #include "compiler.h"
 
@@ -58,6 +65,238 @@ static void randomize(void *p, size_t n, size_t size, unsigned int seed) {
 	}
 }
 
+/* Input distributions for the benchmarks. All but DIST_RANDOM write a key
+ * into the first 1, 2, 4 or 8 bytes of each element (as the tests' less
+ * functions read it, in native byte order) and fill the rest of the element
+ * with copies of it, so that elements with equal keys are identical and an
+ * unstable sort's result can still be compared byte for byte. */
+enum dist_kind {
+	DIST_RANDOM,		/* uniform random bits (randomize) */
+	DIST_SORTED,
+	DIST_REVERSE,
+	DIST_NEARLY_SORTED,	/* sorted, then param% of elements swapped */
+	DIST_FEW_UNIQUE,	/* param distinct keys */
+	DIST_ZIPF,		/* key rank k with probability ~ 1/k */
+	DIST_ORGAN_PIPE,	/* ascending, then descending */
+	DIST_SAWTOOTH,		/* param ascending runs */
+	DIST_ALL_EQUAL,
+	DIST_COUNT
+};
+
+struct dist {
+	enum dist_kind kind;
+	unsigned param;		/* zero for the default */
+};
+
+static inline const char *dist_name(enum dist_kind kind) {
+	switch (kind) {
+	case DIST_RANDOM:	 return "random";
+	case DIST_SORTED:	 return "sorted";
+	case DIST_REVERSE:	 return "reverse";
+	case DIST_NEARLY_SORTED: return "nearly_sorted";
+	case DIST_FEW_UNIQUE:	 return "few_unique";
+	case DIST_ZIPF:		 return "zipf";
+	case DIST_ORGAN_PIPE:	 return "organ_pipe";
+	case DIST_SAWTOOTH:	 return "sawtooth";
+	case DIST_ALL_EQUAL:	 return "all_equal";
+	default:		 return "unknown";
+	}
+}
+
+static inline unsigned dist_param(const struct dist *d) {
+	if (d->param)
+		return d->param;
+	switch (d->kind) {
+	case DIST_NEARLY_SORTED: return 1;
+	case DIST_FEW_UNIQUE:	 return 16;
+	case DIST_SAWTOOTH:	 return 16;
+	default:		 return 0;
+	}
+}
+
+/* parse "name" or "name:param"; returns zero on success */
+static inline int dist_parse(struct dist *d, const char *s) {
+	const char *colon = strchr(s, ':');
+	const size_t len = colon ? (size_t)(colon - s) : strlen(s);
+	int kind;
+
+	for (kind = 0; kind < DIST_COUNT; ++kind) {
+		const char *name = dist_name(kind);
+
+		if (strlen(name) == len && !strncmp(name, s, len))
+			break;
+	}
+	if (kind == DIST_COUNT)
+		return -1;
+
+	d->kind = kind;
+	d->param = colon ? strtoul(colon + 1, NULL, 0) : 0;
+	return 0;
+}
+
+static inline uint64_t _dist_random64(void) {
+	return (uint64_t)random() << 62 ^ (uint64_t)random() << 31 ^ random();
+}
+
+/* width of the key _dist_set writes at the start of size byte elements */
+#define DIST_KEY_WIDTH(size) ((size) >= 8 ? 8 : (size) >= 4 ? 4 : (size) >= 2 ? 2 : 1)
+
+/* the same for a test's ELEM_SIZE, usable in a qsort_def initializer */
+#define MY_KEY_WIDTH DIST_KEY_WIDTH(ELEM_SIZE)
+
+static inline size_t _dist_key_width(size_t size) {
+	return DIST_KEY_WIDTH(size);
+}
+
+/* key of rank r out of n, spread over the key's whole range */
+static inline uint64_t _dist_key(uint64_t r, uint64_t n, size_t width) {
+	const uint64_t max = width == 8 ? UINT64_MAX : (1ull << (width * 8)) - 1;
+
+	return n > max ? r * (max + 1) / n : r * (max / n);
+}
+
+static inline void _dist_set(char *elem, size_t size, uint64_t key) {
+	const size_t width = _dist_key_width(size);
+	uint8_t k8 = key;
+	uint16_t k16 = key;
+	uint32_t k32 = key;
+	size_t off;
+
+	switch (width) {
+	case 1: memcpy(elem, &k8, 1); break;
+	case 2: memcpy(elem, &k16, 2); break;
+	case 4: memcpy(elem, &k32, 4); break;
+	default: memcpy(elem, &key, 8); break;
+	}
+
+	for (off = width; off < size; off += width)
+		memcpy(elem + off, elem, size - off < width ? size - off : width);
+}
+
+static inline void _dist_swap(char *a, char *b, size_t size) {
+	size_t i;
+
+	for (i = 0; i < size; ++i) {
+		char t = a[i];
+
+		a[i] = b[i];
+		b[i] = t;
+	}
+}
+
+/* fill n elements of size bytes at p according to d */
+static inline void generate(void *p, size_t n, size_t size, const struct dist *d,
+			    unsigned int seed) {
+	const size_t width = _dist_key_width(size);
+	const unsigned param = dist_param(d);
+	char *const base = p;
+	size_t i;
+
+	if (d->kind == DIST_RANDOM) {
+		randomize(p, n, size, seed);
+		return;
+	}
+
+	/* nothing to fill, and the picks below would divide by n */
+	if (!n)
+		return;
+
+	srandom(seed);
+
+	switch (d->kind) {
+	case DIST_SORTED:
+	case DIST_NEARLY_SORTED:
+		for (i = 0; i < n; ++i)
+			_dist_set(base + i * size, size, _dist_key(i, n, width));
+
+		if (d->kind == DIST_NEARLY_SORTED) {
+			size_t swaps = n * param / 100 ? n * param / 100 : 1;
+
+			while (swaps--)
+				_dist_swap(base + (size_t)random() % n * size,
+					   base + (size_t)random() % n * size, size);
+		}
+		break;
+
+	case DIST_REVERSE:
+		for (i = 0; i < n; ++i)
+			_dist_set(base + i * size, size, _dist_key(n - 1 - i, n, width));
+		break;
+
+	case DIST_FEW_UNIQUE:
+		for (i = 0; i < n; ++i)
+			_dist_set(base + i * size, size,
+				  _dist_key((size_t)random() % param, param, width));
+		break;
+
+	case DIST_ZIPF: {
+		/* Pick the bit length of the rank uniformly and then the rank
+		 * uniformly among those of that length, so that its density
+		 * falls off as 1/k (Zipf with s = 1) without needing libm. */
+		const unsigned levels = sizeof(size_t) * 8 - __builtin_clzl(n);
+
+		for (i = 0; i < n; ++i) {
+			size_t rank;
+
+			do {
+				unsigned level = (unsigned)random() % levels;
+
+				rank = ((size_t)1 << level)
+				     + (size_t)_dist_random64() % ((size_t)1 << level);
+			} while (rank > n);
+
+			_dist_set(base + i * size, size, _dist_key(rank - 1, n, width));
+		}
+		break;
+	}
+
+	case DIST_ORGAN_PIPE:
+		for (i = 0; i < n; ++i)
+			_dist_set(base + i * size, size,
+				  _dist_key(i < n - 1 - i ? i : n - 1 - i, (n + 1) / 2, width));
+		break;
+
+	case DIST_SAWTOOTH: {
+		const size_t period = (n + param - 1) / param;
+
+		for (i = 0; i < n; ++i)
+			_dist_set(base + i * size, size,
+				  _dist_key(i % period, period, width));
+		break;
+	}
+
+	case DIST_ALL_EQUAL: {
+		const uint64_t key = _dist_random64();
+
+		for (i = 0; i < n; ++i)
+			_dist_set(base + i * size, size, key);
+		break;
+	}
+
+	default:
+		assert(0);
+	}
+}
+
+/* sum of a hash of each element's bytes: the same for any order of them */
+static inline uint64_t multiset_hash(const void *p, size_t n, size_t size) {
+	const unsigned char *c = p;
+	uint64_t sum = 0;
+	size_t i, j;
+
+	for (i = 0; i < n; ++i, c += size) {
+		uint64_t h = 0xcbf29ce484222325ull;
+
+		for (j = 0; j < size; ++j)
+			h = (h ^ c[j]) * 0x100000001b3ull;
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdull;
+		h ^= h >> 33;
+		sum += h;
+	}
+	return sum;
+}
+
 static inline void timespec_set(struct timespec *ts) {
 	if (unlikely(errno = clock_gettime(CLOCK_THREAD_CPUTIME_ID, ts)))
 		fatal_error("clock_gettime");
@@ -78,6 +317,13 @@ static inline struct timespec timespec_subtract(struct timespec a, struct timesp
 	return ret;
 }
 
+/* seconds from start to end */
+static inline double elapsed(struct timespec start, struct timespec end) {
+	struct timespec t = timespec_subtract(end, start);
+
+	return t.tv_sec + t.tv_nsec / 1000000000.;
+}
+
 static inline struct timespec timespec_add(struct timespec a, struct timespec b) {
 	const long ONE_BILLION = 1000000000ul;
 	struct timespec ret = {
@@ -93,11 +339,294 @@ static inline struct timespec timespec_add(struct timespec a, struct timespec b)
 	return ret;
 }
 
-static double time_pct(struct timespec *a, struct timespec *b) {
+static inline double time_pct(struct timespec *a, struct timespec *b) {
 	const double ONE_BILLION = 1000000000.;
 	double da = (double)a->tv_nsec + ONE_BILLION *a->tv_sec;
 	double db = (double)b->tv_nsec + ONE_BILLION *b->tv_sec;
 	return ((da / db) - 1.) * 100.;
 }
 
+/* Per call latency samples: a log-linear (HDR style) histogram with
+ * 2^_HIST_SUB_BITS buckets per power of two, so that any percentile is
+ * within about 3% of the real value, plus a running mean and variance
+ * (Welford's method) for confidence intervals and Welch's t-test. */
+#define _HIST_SUB_BITS	5
+#define _HIST_SUB	(1u << _HIST_SUB_BITS)
+#define _HIST_BUCKETS	((64 - _HIST_SUB_BITS + 1) * _HIST_SUB)
+
+struct sample_stats {
+	uint64_t count;
+	double mean;
+	double m2;		/* sum of squared differences from the mean */
+};
+
+struct latency_hist {
+	struct sample_stats stats;
+	uint64_t min;
+	uint64_t max;
+	uint64_t bucket[_HIST_BUCKETS];
+};
+
+static inline void hist_reset(struct latency_hist *h) {
+	memset(h, 0, sizeof(*h));
+	h->min = UINT64_MAX;
+}
+
+static inline unsigned _hist_index(uint64_t v) {
+	unsigned shift;
+
+	if (v < _HIST_SUB)
+		return v;
+	shift = 63 - __builtin_clzll(v) - _HIST_SUB_BITS;
+	return (shift + 1) * _HIST_SUB + (v >> shift) - _HIST_SUB;
+}
+
+/* the middle of the values that land in bucket i */
+static inline uint64_t _hist_value(unsigned i) {
+	unsigned shift;
+
+	if (i < _HIST_SUB)
+		return i;
+	shift = i / _HIST_SUB - 1;
+	return ((uint64_t)(i % _HIST_SUB + _HIST_SUB) << shift)
+	       + ((uint64_t)1 << shift) / 2;
+}
+
+static inline void hist_add(struct latency_hist *h, uint64_t v) {
+	struct sample_stats *s = &h->stats;
+	double delta = v - s->mean;
+
+	++h->bucket[_hist_index(v)];
+	if (v < h->min)
+		h->min = v;
+	if (v > h->max)
+		h->max = v;
+
+	++s->count;
+	s->mean += delta / s->count;
+	s->m2 += delta * (v - s->mean);
+}
+
+/* the value below which pct percent of the samples fall */
+static inline uint64_t hist_percentile(const struct latency_hist *h, double pct) {
+	uint64_t rank = (uint64_t)(pct / 100. * h->stats.count + .5);
+	uint64_t seen = 0;
+	unsigned i;
+
+	if (!h->stats.count)
+		return 0;
+	if (rank < 1)
+		rank = 1;
+
+	for (i = 0; i < _HIST_BUCKETS; ++i) {
+		seen += h->bucket[i];
+		if (seen >= rank) {
+			uint64_t v = _hist_value(i);
+
+			return v < h->min ? h->min : v > h->max ? h->max : v;
+		}
+	}
+	return h->max;
+}
+
+static inline double sample_variance(const struct sample_stats *s) {
+	return s->count > 1 ? s->m2 / (s->count - 1) : 0.;
+}
+
+/* two-sided 95% critical value of Student's t distribution */
+static inline double t_crit95(double df) {
+	static const double table[] = {
+		12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262,
+		2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101,
+		2.093, 2.086, 2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052,
+		2.048, 2.045, 2.042
+	};
+
+	if (df < 1.)
+		df = 1.;
+	if (df <= 30.)
+		return table[(unsigned)df - 1];
+	return df <= 40. ? 2.021 : df <= 60. ? 2.000 : df <= 120. ? 1.980 : 1.960;
+}
+
+/* half the width of the 95% confidence interval of the mean */
+static inline double sample_ci95(const struct sample_stats *s) {
+	if (s->count < 2)
+		return 0.;
+	return t_crit95(s->count - 1) * sqrt(sample_variance(s) / s->count);
+}
+
+/* Welch's t-test for a difference in means; stores t and returns non-zero
+ * if the difference is significant at the 5% level */
+static inline int welch_t_test(const struct sample_stats *a,
+			       const struct sample_stats *b, double *t) {
+	double va, vb, se2, df;
+
+	*t = 0.;
+	if (a->count < 2 || b->count < 2)
+		return 0;
+
+	va = sample_variance(a) / a->count;
+	vb = sample_variance(b) / b->count;
+	se2 = va + vb;
+	if (se2 == 0.)
+		return a->mean != b->mean;
+
+	*t = (a->mean - b->mean) / sqrt(se2);
+	/* Welch-Satterthwaite degrees of freedom */
+	df = se2 * se2 / (va * va / (a->count - 1) + vb * vb / (b->count - 1));
+	return fabs(*t) > t_crit95(df);
+}
+
+static inline uint64_t timespec_ns(struct timespec ts) {
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* Performance counters, opened as one group and read around each measured
+ * call. Counters the kernel or machine can't provide (as in many containers
+ * and VMs) are left out, and with none at all the group is just a no-op. */
+enum perf_counter {
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_BRANCH_MISSES,
+	PERF_CACHE_REFS,
+	PERF_CACHE_MISSES,
+	PERF_DTLB_MISSES,
+	PERF_PAGE_FAULTS,
+	PERF_COUNTER_COUNT
+};
+
+struct perf_group {
+	int leader;				/* -1 if nothing could be opened */
+	int fd[PERF_COUNTER_COUNT];		/* -1 if unavailable */
+	uint64_t id[PERF_COUNTER_COUNT];
+	uint64_t total[PERF_COUNTER_COUNT];	/* summed over perf_stop calls */
+};
+
+static inline const char *perf_counter_name(enum perf_counter c) {
+	switch (c) {
+	case PERF_CYCLES:	 return "cycles";
+	case PERF_INSTRUCTIONS:	 return "instructions";
+	case PERF_BRANCH_MISSES: return "branch-misses";
+	case PERF_CACHE_REFS:	 return "cache-references";
+	case PERF_CACHE_MISSES:	 return "cache-misses";
+	case PERF_DTLB_MISSES:	 return "dTLB-load-misses";
+	case PERF_PAGE_FAULTS:	 return "page-faults";
+	default:		 return "unknown";
+	}
+}
+
+static inline void _perf_attr(enum perf_counter c, struct perf_event_attr *attr) {
+	memset(attr, 0, sizeof(*attr));
+	attr->size = sizeof(*attr);
+	attr->type = PERF_TYPE_HARDWARE;
+
+	switch (c) {
+	case PERF_CYCLES:	 attr->config = PERF_COUNT_HW_CPU_CYCLES; break;
+	case PERF_INSTRUCTIONS:	 attr->config = PERF_COUNT_HW_INSTRUCTIONS; break;
+	case PERF_BRANCH_MISSES: attr->config = PERF_COUNT_HW_BRANCH_MISSES; break;
+	case PERF_CACHE_REFS:	 attr->config = PERF_COUNT_HW_CACHE_REFERENCES; break;
+	case PERF_CACHE_MISSES:	 attr->config = PERF_COUNT_HW_CACHE_MISSES; break;
+	case PERF_DTLB_MISSES:
+		attr->type = PERF_TYPE_HW_CACHE;
+		attr->config = PERF_COUNT_HW_CACHE_DTLB
+			     | PERF_COUNT_HW_CACHE_OP_READ << 8
+			     | PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+		break;
+	default:
+		attr->type = PERF_TYPE_SOFTWARE;
+		attr->config = PERF_COUNT_SW_PAGE_FAULTS;
+		break;
+	}
+
+	/* user space only, so that perf_event_paranoid = 2 still allows it */
+	attr->disabled = 1;
+	attr->exclude_kernel = 1;
+	attr->exclude_hv = 1;
+	attr->read_format = PERF_FORMAT_GROUP | PERF_FORMAT_ID
+			  | PERF_FORMAT_TOTAL_TIME_ENABLED
+			  | PERF_FORMAT_TOTAL_TIME_RUNNING;
+}
+
+/* open what counters we can for the calling thread; returns how many, or
+ * zero with errno set by the first failure */
+static inline int perf_open(struct perf_group *g) {
+	int first_errno = 0;
+	int count = 0;
+	int c;
+
+	memset(g, 0, sizeof(*g));
+	g->leader = -1;
+
+	for (c = 0; c < PERF_COUNTER_COUNT; ++c) {
+		struct perf_event_attr attr;
+
+		_perf_attr(c, &attr);
+		g->fd[c] = syscall(SYS_perf_event_open, &attr, 0, -1, g->leader, 0);
+		if (g->fd[c] < 0 || ioctl(g->fd[c], PERF_EVENT_IOC_ID, &g->id[c])) {
+			if (!first_errno)
+				first_errno = errno;
+			if (g->fd[c] >= 0)
+				close(g->fd[c]);
+			g->fd[c] = -1;
+			continue;
+		}
+
+		if (g->leader < 0)
+			g->leader = g->fd[c];
+		++count;
+	}
+
+	if (!count)
+		errno = first_errno;
+	return count;
+}
+
+/* safe on a group perf_open never touched, as long as its leader is -1 */
+static inline void perf_close(struct perf_group *g) {
+	int c;
+
+	if (g->leader < 0)
+		return;
+
+	for (c = 0; c < PERF_COUNTER_COUNT; ++c) {
+		if (g->fd[c] >= 0)
+			close(g->fd[c]);
+		g->fd[c] = -1;
+	}
+	g->leader = -1;
+}
+
+static inline void perf_start(struct perf_group *g) {
+	if (g->leader < 0)
+		return;
+	ioctl(g->leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	ioctl(g->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+/* stop counting and add the counts to g->total, scaled up if the group
+ * had to share the PMU with others */
+static inline void perf_stop(struct perf_group *g) {
+	uint64_t buf[3 + 2 * PERF_COUNTER_COUNT];
+	uint64_t i;
+	int c;
+
+	if (g->leader < 0)
+		return;
+	ioctl(g->leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+	if (read(g->leader, buf, sizeof(buf)) < (ssize_t)(3 * sizeof(*buf)))
+		return;
+
+	/* buf: nr, time_enabled, time_running, then nr (value, id) pairs */
+	for (i = 0; i < buf[0] && i < PERF_COUNTER_COUNT; ++i) {
+		uint64_t value = buf[3 + 2 * i];
+
+		if (buf[2] && buf[2] < buf[1])
+			value = (double)value * buf[1] / buf[2];
+		for (c = 0; c < PERF_COUNTER_COUNT; ++c)
+			if (g->fd[c] >= 0 && g->id[c] == buf[4 + 2 * i])
+				g->total[c] += value;
+	}
+}
+
 #endif /* _UTILS_H_ */